@@ -0,0 +1,329 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <util/parms.h>
+
+#include <QString>
+#include <QStringList>
+#include <QFile>
+#include <QTextStream>
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <chrono>
+#include <algorithm>
+
+#include "compiled_graph.h"
+#include "native_ops.h"
+#include "native_solver.h"
+
+using cellflips::out;
+
+// Autotuning of the native solver (Main/Autotune in view.v).
+//
+// Each line of AutotuneFile is a candidate configuration of the [Solver]
+// section, as `key: value' pairs separated by `;', e.g.
+//
+//   Solver: ParallelCrankNicholson; CRController: PI; CRTol: 1e-4
+//
+// The first line is the reference, which should be tight. Every candidate
+// integrates AutotuneTime units of time from the current state, with the
+// [Solver] section of the view file where its keys are replaced. Its cost
+// is the wall-clock time per unit of simulated time, and its error the
+// largest difference of a concentration with the reference at the end.
+//
+// The candidates which are not both cheaper and more accurate than another
+// one form the Pareto front. It is written in AutotuneOutput as comments,
+// followed by the [Solver] keys of the cheapest candidate whose error is
+// below AutotuneTol (or the most accurate one), to be copied into view.v.
+class SolverAutotune
+{
+public:
+  struct Candidate
+  {
+    QStringList keys, values;   // [Solver] keys replaced in the view file
+    bool ok = false;            // the trial reached the end time
+    double cost = 0;            // seconds per unit of simulated time
+    double error = 0;           // largest difference with the reference
+    size_t steps = 0;
+    size_t rejected = 0;
+
+    QString description() const
+    {
+      QStringList pairs;
+      for(int k = 0 ; k < keys.size() ; ++k)
+        pairs << keys[k] + ": " + values[k];
+      return pairs.join("; ");
+    }
+  };
+
+  void readParms(util::Parms& parms, const QString& section)
+  {
+    parms(section, "AutotuneFile", filename);
+    parms(section, "AutotuneTime", trial_time);
+    parms(section, "AutotuneTol", tol);
+    parms(section, "AutotuneMaxSeconds", max_seconds);
+    parms(section, "AutotuneOutput", output);
+  }
+
+  // Read the candidates, returns false if there is none
+  bool readFile()
+  {
+    candidates.clear();
+    QFile file(filename);
+    if(not file.open(QIODevice::ReadOnly)) {
+      out << "Error, cannot open file '" << filename << "' for reading" << endl;
+      return false;
+    }
+    QTextStream ts(&file);
+    while(not ts.atEnd()) {
+      QString line = ts.readLine().simplified();
+      if(line.isEmpty() or line.startsWith("#"))
+        continue;
+      Candidate cand;
+      for(const QString& pair: line.split(';', QString::SkipEmptyParts)) {
+        int colon = pair.indexOf(':');
+        if(colon < 0) {
+          out << "Error, expected 'key: value' in '" << pair << "' of '" << filename << "'" << endl;
+          return false;
+        }
+        cand.keys << pair.left(colon).trimmed();
+        cand.values << pair.mid(colon + 1).trimmed();
+      }
+      if(not cand.keys.contains("Solver")) {
+        out << "Error, no Solver in '" << line << "' of '" << filename << "'" << endl;
+        return false;
+      }
+      candidates.push_back(cand);
+    }
+    if(candidates.empty()) {
+      out << "Error, no configuration in '" << filename << "'" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Run the trials from the state of G, which is restored afterwards, and
+  // write the result. view_file is the view file the candidates modify.
+  template <typename Model>
+  bool operator()(CompiledGraph& G, Model& model, const QString& view_file)
+  {
+    if(not readFile() or not readView(view_file))
+      return false;
+    const std::vector<SolverPoint5> c0 = G.c;
+    const std::vector<SolverPoint5> dc0 = G.dc;
+    std::vector<std::vector<SolverPoint5> > results(candidates.size());
+    for(size_t k = 0 ; k < candidates.size() ; ++k) {
+      G.c = c0;
+      G.dc = dc0;
+      trial(G, model, candidates[k], results[k]);
+    }
+    G.c = c0;
+    G.dc = dc0;
+    G.stateChanged();
+
+    if(not candidates[0].ok) {
+      out << "Error, the reference configuration of the autotuning failed" << endl;
+      return false;
+    }
+    for(size_t k = 0 ; k < candidates.size() ; ++k)
+      if(candidates[k].ok)
+        candidates[k].error = difference(results[k], results[0]);
+    report();
+    return writeOutput();
+  }
+
+  QString filename = "autotune.txt";
+  QString output = "autotune.v";
+  double trial_time = 5;        // simulated time of each trial
+  double tol = 1e-3;            // largest error of the selected configuration
+  double max_seconds = 600;     // a trial running longer fails
+  std::vector<Candidate> candidates;
+
+protected:
+  // Integrate from the current state of G with the candidate, to exactly
+  // trial_time for the adaptive solvers
+  template <typename Model>
+  void trial(CompiledGraph& G, Model& model, Candidate& cand, std::vector<SolverPoint5>& result)
+  {
+    const QString trial_file = "autotune_trial.v";
+    if(not writeView(trial_file, cand))
+      return;
+    NativeSolver solver;
+    QString name = cand.values[cand.keys.indexOf("Solver")];
+    if(not solver.setMethod(name)) {
+      out << "Autotune: solver '" << name << "' is not available, skipped" << endl;
+      QFile::remove(trial_file);
+      return;
+    }
+    {
+      util::Parms parms(trial_file);
+      solver.readParms(parms, "Solver");
+    }
+    QFile::remove(trial_file);
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::time_point start = Clock::now();
+    double t = 0, elapsed = 0;
+    while(t < trial_time) {
+      solver.limitStep(trial_time - t);
+      solver(G, model);
+      t += solver.dt;
+      elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+      if(not (solver.dt > 0) or elapsed > max_seconds)
+        break;
+    }
+    if(t < trial_time) {
+      out << "Autotune: '" << cand.description() << "' failed at time " << t << endl;
+      return;
+    }
+    // The fixed step solvers may end after trial_time
+    result = G.c;
+    native::axpy(result, result, trial_time - t, G.dc);
+    for(const SolverPoint5& x: result)
+      for(size_t a = 0 ; a < 5 ; ++a)
+        if(not std::isfinite(double(x[a]))) {
+          out << "Autotune: '" << cand.description() << "' diverged" << endl;
+          return;
+        }
+    cand.ok = true;
+    cand.cost = elapsed / trial_time;
+    cand.steps = solver.stats.steps;
+    cand.rejected = solver.stats.rejected;
+  }
+
+  static double difference(const std::vector<SolverPoint5>& x, const std::vector<SolverPoint5>& y)
+  {
+    return native::maxReduce(x.size(), [&x, &y](size_t i) {
+                               double m = 0;
+                               for(size_t a = 0 ; a < 5 ; ++a)
+                                 m = std::max(m, std::abs(double(x[i][a]) - double(y[i][a])));
+                               return m;
+                             });
+  }
+
+  // Indices of the successful candidates not beaten in both cost and
+  // error, by increasing cost
+  std::vector<size_t> paretoFront() const
+  {
+    std::vector<size_t> order;
+    for(size_t k = 0 ; k < candidates.size() ; ++k)
+      if(candidates[k].ok)
+        order.push_back(k);
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+                const Candidate& ca = candidates[a];
+                const Candidate& cb = candidates[b];
+                return ca.cost < cb.cost or (ca.cost == cb.cost and ca.error < cb.error);
+              });
+    std::vector<size_t> front;
+    double best_error = std::numeric_limits<double>::infinity();
+    for(size_t k: order)
+      if(candidates[k].error < best_error) {
+        front.push_back(k);
+        best_error = candidates[k].error;
+      }
+    return front;
+  }
+
+  // Cheapest candidate of the front below tol, or the most accurate one
+  size_t selected(const std::vector<size_t>& front) const
+  {
+    for(size_t k: front)
+      if(candidates[k].error <= tol)
+        return k;
+    return front.back();
+  }
+
+  void report() const
+  {
+    out << "Autotune over " << trial_time << " units of time:" << endl;
+    for(const Candidate& cand: candidates) {
+      if(not cand.ok)
+        continue;
+      out << "  " << cand.description() << ": " << cand.cost << " s per unit time, error "
+          << cand.error << ", " << cand.steps << " steps, " << cand.rejected << " rejected" << endl;
+    }
+  }
+
+  bool writeOutput() const
+  {
+    std::vector<size_t> front = paretoFront();
+    const Candidate& best = candidates[selected(front)];
+    QFile file(output);
+    if(not file.open(QIODevice::WriteOnly)) {
+      out << "Error, cannot open file '" << output << "' for writing" << endl;
+      return false;
+    }
+    QTextStream ts(&file);
+    ts << "// Solver autotuning over " << trial_time << " units of time, error tolerance "
+       << tol << endl;
+    ts << "// Pareto front (seconds per unit time, largest error):" << endl;
+    for(size_t k: front)
+      ts << "//   " << candidates[k].cost << " " << candidates[k].error << " "
+         << candidates[k].description() << endl;
+    ts << "[Solver]" << endl;
+    for(int k = 0 ; k < best.keys.size() ; ++k)
+      ts << best.keys[k] << ": " << best.values[k] << endl;
+    out << "Autotune: selected '" << best.description() << "', written to " << output << endl;
+    return true;
+  }
+
+  bool readView(const QString& view_file)
+  {
+    QFile file(view_file);
+    if(not file.open(QIODevice::ReadOnly)) {
+      out << "Error, cannot open file '" << view_file << "' for reading" << endl;
+      return false;
+    }
+    QTextStream ts(&file);
+    view.clear();
+    while(not ts.atEnd())
+      view << ts.readLine();
+    return true;
+  }
+
+  // Copy of the view file where the [Solver] keys of cand are replaced
+  bool writeView(const QString& name, const Candidate& cand) const
+  {
+    QFile file(name);
+    if(not file.open(QIODevice::WriteOnly)) {
+      out << "Error, cannot open file '" << name << "' for writing" << endl;
+      return false;
+    }
+    QTextStream ts(&file);
+    std::vector<bool> written(cand.keys.size(), false);
+    bool in_solver = false;
+    auto writeMissing = [&]() {
+      for(int k = 0 ; k < cand.keys.size() ; ++k)
+        if(not written[k]) {
+          ts << cand.keys[k] << ": " << cand.values[k] << endl;
+          written[k] = true;
+        }
+    };
+    for(const QString& line: view) {
+      QString trimmed = line.trimmed();
+      if(trimmed.startsWith("[")) {
+        if(in_solver)
+          writeMissing();
+        in_solver = (trimmed == "[Solver]");
+      } else if(in_solver) {
+        int colon = trimmed.indexOf(':');
+        int k = colon > 0 ? cand.keys.indexOf(trimmed.left(colon).trimmed()) : -1;
+        if(k >= 0) {
+          ts << cand.keys[k] << ": " << cand.values[k] << endl;
+          written[k] = true;
+          continue;
+        }
+      }
+      ts << line << endl;
+    }
+    if(in_solver)
+      writeMissing();
+    return true;
+  }
+
+  QStringList view;   // lines of the view file
+};
+
+#endif // AUTOTUNE_H
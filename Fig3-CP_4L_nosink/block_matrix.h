@@ -0,0 +1,280 @@
+#ifndef BLOCK_MATRIX_H
+#define BLOCK_MATRIX_H
+
+#include <util/assert.h>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "compiled_graph.h"
+
+// Dense 5x5 block, coupling the chemicals of two nodes: v[a][b] is the
+// derivative of chemical a of the row node with respect to chemical b of the
+// column node.
+struct Block5
+{
+  double v[5][5];
+
+  void zero()
+  {
+    for(size_t a = 0 ; a < 5 ; ++a)
+      for(size_t b = 0 ; b < 5 ; ++b)
+        v[a][b] = 0;
+  }
+
+  Block5& operator-=(const Block5& B)
+  {
+    for(size_t a = 0 ; a < 5 ; ++a)
+      for(size_t b = 0 ; b < 5 ; ++b)
+        v[a][b] -= B.v[a][b];
+    return *this;
+  }
+
+  Block5 operator*(const Block5& B) const
+  {
+    Block5 C;
+    for(size_t a = 0 ; a < 5 ; ++a)
+      for(size_t b = 0 ; b < 5 ; ++b) {
+        double s = 0;
+        for(size_t k = 0 ; k < 5 ; ++k)
+          s += v[a][k] * B.v[k][b];
+        C.v[a][b] = s;
+      }
+    return C;
+  }
+
+  // Inverse by Gauss-Jordan elimination with partial pivoting, returns false
+  // if the block is singular
+  bool invert(Block5& inv) const
+  {
+    Block5 A = *this;
+    for(size_t a = 0 ; a < 5 ; ++a)
+      for(size_t b = 0 ; b < 5 ; ++b)
+        inv.v[a][b] = (a == b) ? 1 : 0;
+    for(size_t col = 0 ; col < 5 ; ++col) {
+      size_t pivot = col;
+      for(size_t a = col+1 ; a < 5 ; ++a)
+        if(std::abs(A.v[a][col]) > std::abs(A.v[pivot][col]))
+          pivot = a;
+      if(A.v[pivot][col] == 0)
+        return false;
+      if(pivot != col)
+        for(size_t b = 0 ; b < 5 ; ++b) {
+          std::swap(A.v[pivot][b], A.v[col][b]);
+          std::swap(inv.v[pivot][b], inv.v[col][b]);
+        }
+      double d = 1 / A.v[col][col];
+      for(size_t b = 0 ; b < 5 ; ++b) {
+        A.v[col][b] *= d;
+        inv.v[col][b] *= d;
+      }
+      for(size_t a = 0 ; a < 5 ; ++a) {
+        if(a == col or A.v[a][col] == 0)
+          continue;
+        double f = A.v[a][col];
+        for(size_t b = 0 ; b < 5 ; ++b) {
+          A.v[a][b] -= f * A.v[col][b];
+          inv.v[a][b] -= f * inv.v[col][b];
+        }
+      }
+    }
+    return true;
+  }
+
+  Point5d operator*(const Point5d& x) const
+  {
+    Point5d y;
+    for(size_t a = 0 ; a < 5 ; ++a) {
+      double s = 0;
+      for(size_t b = 0 ; b < 5 ; ++b)
+        s += v[a][b] * x[b];
+      y[a] = s;
+    }
+    return y;
+  }
+};
+
+// Sparse matrix of 5x5 blocks with the structure of a CompiledGraph: row i
+// holds the diagonal block of node i and one block per neighbor, sorted by
+// column.
+struct BlockMatrix
+{
+  std::vector<size_t> offsets;    // first block of each row, N+1 elements
+  std::vector<size_t> columns;    // column node of each block
+  std::vector<size_t> diagonals;  // position of the diagonal block of each row
+  std::vector<Block5> blocks;
+
+  size_t nbRows() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+  size_t begin(size_t i) const { return offsets[i]; }
+  size_t end(size_t i) const { return offsets[i+1]; }
+
+  Block5& diagonal(size_t i) { return blocks[diagonals[i]]; }
+  const Block5& diagonal(size_t i) const { return blocks[diagonals[i]]; }
+
+  // Copy the sparsity of G. Needs to be called again if G is rebuilt.
+  void setStructure(const CompiledGraph& G)
+  {
+    size_t N = G.nbNodes();
+    offsets.resize(N+1);
+    columns.resize(G.neighbors.size() + N);
+    for(size_t i = 0 ; i <= N ; ++i)
+      offsets[i] = G.offsets[i] + i;
+    diagonals.resize(N);
+    for(size_t i = 0 ; i < N ; ++i) {
+      size_t k = offsets[i];
+      columns[k++] = i;
+      for(size_t l = G.begin(i) ; l < G.end(i) ; ++l)
+        columns[k++] = G.neighbors[l];
+      std::sort(columns.begin() + begin(i), columns.begin() + end(i));
+      diagonals[i] = find(i, i);
+    }
+    blocks.resize(columns.size());
+  }
+
+  // Position of the block (i,j), or end(i) if j is not a neighbor of i
+  size_t find(size_t i, size_t j) const
+  {
+    std::vector<size_t>::const_iterator first = columns.begin() + begin(i);
+    std::vector<size_t>::const_iterator last = columns.begin() + end(i);
+    std::vector<size_t>::const_iterator it = std::lower_bound(first, last, j);
+    if(it != last and *it == j)
+      return it - columns.begin();
+    return end(i);
+  }
+
+  // Accumulates the entries of one row, see assemble()
+  class RowAssembler
+  {
+  public:
+    RowAssembler(BlockMatrix& M, size_t i)
+      : M(M)
+      , i(i)
+      , last_column(i)
+      , last_block(M.diagonals[i])
+    {}
+
+    // Add v to the derivative of chemical a of the row node with respect to
+    // chemical b of node j, which must be a neighbor of the row node
+    void operator()(size_t a, size_t j, size_t b, double v)
+    {
+      if(j != last_column) {
+        last_column = j;
+        last_block = M.find(i, j);
+        vvassert(last_block < M.end(i));
+      }
+      M.blocks[last_block].v[a][b] += v;
+    }
+
+  private:
+    BlockMatrix& M;
+    size_t i;
+    size_t last_column, last_block;
+  };
+
+  // Fill the matrix row by row, in parallel. row(i, emit) must call
+  // emit(a, j, b, v) for each entry of row i.
+  template <typename RowFunction>
+  void assemble(const RowFunction& row)
+  {
+    const long N = nbRows();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i) {
+      for(size_t k = begin(i) ; k < end(i) ; ++k)
+        blocks[k].zero();
+      RowAssembler emit(*this, i);
+      row(i, emit);
+    }
+  }
+
+  // M = a M + d I
+  void scaleAddIdentity(double a, double d)
+  {
+    const long N = nbRows();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i) {
+      for(size_t k = begin(i) ; k < end(i) ; ++k)
+        for(size_t p = 0 ; p < 5 ; ++p)
+          for(size_t q = 0 ; q < 5 ; ++q)
+            blocks[k].v[p][q] *= a;
+      Block5& D = diagonal(i);
+      for(size_t p = 0 ; p < 5 ; ++p)
+        D.v[p][p] += d;
+    }
+  }
+
+  // Set the diagonal entry of the rows which are empty to 1, for the
+  // chemicals which are not modelled in a node (or are held fixed)
+  void setEmptyRowsToIdentity()
+  {
+    const long N = nbRows();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      for(size_t p = 0 ; p < 5 ; ++p) {
+        bool empty = true;
+        for(size_t k = begin(i) ; k < end(i) and empty ; ++k)
+          for(size_t q = 0 ; q < 5 ; ++q)
+            if(blocks[k].v[p][q] != 0) {
+              empty = false;
+              break;
+            }
+        if(empty)
+          diagonal(i).v[p][p] = 1;
+      }
+  }
+
+  // y = M x
+  void multiply(const std::vector<Point5d>& x, std::vector<Point5d>& y) const
+  {
+    const long N = nbRows();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i) {
+      Point5d s = Point5d(0, 0, 0, 0, 0);
+      for(size_t k = begin(i) ; k < end(i) ; ++k)
+        s += blocks[k] * x[columns[k]];
+      y[i] = s;
+    }
+  }
+};
+
+// Emitters for the rows of a matrix which is not assembled, with the same
+// interface as BlockMatrix::RowAssembler.
+
+// Product of the row with x, accumulated in s
+struct RowProduct
+{
+  RowProduct(const std::vector<Point5d>& x)
+    : x(x)
+    , s(0, 0, 0, 0, 0)
+  {}
+
+  void operator()(size_t a, size_t j, size_t b, double v)
+  {
+    s[a] += v * x[j][b];
+  }
+
+  const std::vector<Point5d>& x;
+  Point5d s;
+};
+
+// Diagonal block of row i, accumulated in D
+struct RowDiagonal
+{
+  RowDiagonal(size_t i, Block5& D)
+    : i(i)
+    , D(D)
+  {
+    D.zero();
+  }
+
+  void operator()(size_t a, size_t j, size_t b, double v)
+  {
+    if(j == i)
+      D.v[a][b] += v;
+  }
+
+  size_t i;
+  Block5& D;
+};
+
+#endif // BLOCK_MATRIX_H
@@ -0,0 +1,620 @@
+#ifndef COMPILED_GRAPH_H
+#define COMPILED_GRAPH_H
+
+#include <vector>
+#include <algorithm>
+
+#include "structure.h"
+
+// Precision of the concentrations stored by the native solvers. Building
+// with -DSOLVER_FLOAT_STATE (make FLOAT_STATE=1) stores them as floats, which
+// halves the memory traffic of the derivative evaluation and of the vector
+// updates. The arithmetic, norms and reductions are still done in double.
+#ifdef SOLVER_FLOAT_STATE
+typedef float SolverReal;
+#else
+typedef double SolverReal;
+#endif
+typedef util::Vector<5,SolverReal> SolverPoint5;
+
+// Adjacency restricted to one pair of node types, in CSR form. Row r lists
+// the ids of the neighbors of the r-th node of the source type, and ratio
+// the geometric factor of the exchange along each edge (exchange surface or
+// length divided by the size of the source node).
+struct TypedAdjacency
+{
+  std::vector<size_t> offsets;
+  std::vector<size_t> ids;
+  std::vector<double> ratio;
+
+  size_t begin(size_t r) const { return offsets[r]; }
+  size_t end(size_t r) const { return offsets[r+1]; }
+
+  void clear()
+  {
+    offsets.clear();
+    ids.clear();
+    ratio.clear();
+  }
+};
+
+// Reaction coefficients of a node, which depend on the type of the node and
+// of its cell. They are filled by the model when the graph is built and each
+// time the PIN excess of the cells is updated.
+struct ReactionCoefs
+{
+  double auxin_production = 0;      // cells
+  double auxin_turnover = 0;        // cells
+  double PIN_base_production = 0;   // cells, see Kinetics::PIN_production
+  double PIN_auxin_production = 0;  // cells
+  double PIN_turnover = 0;          // cells
+  double AUX = 0;                   // membranes, AUX/LAX concentration
+  double VAF_production = 0;        // membranes, surface production of VAF
+  double PIN_mask = 1;              // cells and membranes, 0 in sinks
+
+  bool operator==(const ReactionCoefs& k) const
+  {
+    return auxin_production == k.auxin_production and auxin_turnover == k.auxin_turnover
+      and PIN_base_production == k.PIN_base_production
+      and PIN_auxin_production == k.PIN_auxin_production and PIN_turnover == k.PIN_turnover
+      and AUX == k.AUX and VAF_production == k.VAF_production and PIN_mask == k.PIN_mask;
+  }
+};
+
+// Numbering of the nodes of the CompiledGraph
+enum NodeOrdering
+{
+  ORDER_SOLVER_GRAPH,  // iteration order of the SolverGraph
+  ORDER_RCM            // reverse Cuthill-McKee, neighbors close in memory
+};
+
+// Compiled, contiguous version of the SolverGraph.
+//
+// The concentrations and their derivatives are stored in dense arrays
+// indexed by the node id (see node::id), and the neighborhoods in compressed
+// sparse row (CSR) form: the neighbors of node i are
+//
+//   neighbors[offsets[i]], ..., neighbors[offsets[i+1]-1]
+//
+// The topology is fixed once built, only the content of the arrays is
+// modified by the solver.
+//
+// The SolverGraph lists the cells first, then the membranes and apoplasts,
+// so neighbors are far apart in its iteration order. By default the nodes
+// are renumbered with reverse Cuthill-McKee, which keeps a cell, its
+// membranes and their apoplasts close together in the arrays and reduces the
+// bandwidth of the Jacobian. graph_index keeps the position of each node in
+// the SolverGraph.
+//
+// The transport coefficients along each typed edge are precomputed, so the
+// derivative evaluation never needs to search the SolverGraph for an edge.
+// They must be recomputed with updateGeometry() when the geometry changes and
+// are recomputed by setDiffusion() when the diffusion coefficients change,
+// which increments transport_version.
+//
+// Likewise, state_version is incremented whenever c is written: by the
+// native solver after each step, and through stateChanged() by everything
+// else. The multistep solvers compare it to detect that their history no
+// longer ends at the current state.
+//
+// The tissue is only synchronised with the arrays on request (syncTissue),
+// using the typed handles of the cells, membranes and apoplasts.
+//
+// The neighborhoods are also split by node type, so the derivatives can be
+// evaluated in three homogeneous sweeps (cells, membranes, apoplasts) which
+// never need to test the type of a neighbor. By construction of the
+// SolverGraph, each membrane has exactly one cell and one apoplast.
+struct CompiledGraph
+{
+  std::vector<node> nodes;        // SolverGraph node for each id
+  std::vector<size_t> graph_index;  // position of each node in the SolverGraph
+  std::vector<NodeType> type;     // type of each node
+  std::vector<double> size;       // volume or area, depending on the node type
+  std::vector<SolverPoint5> c, dc;  // concentrations and time derivatives
+  std::vector<ReactionCoefs> coefs;  // reaction coefficients of each node
+
+  std::vector<size_t> offsets;    // CSR offsets, nbNodes()+1 elements
+  std::vector<size_t> neighbors;  // CSR neighbor ids
+
+  std::vector<size_t> cells, membranes, apoplasts;  // node ids, by type
+  std::vector<size_t> rank;       // position of each node in its type list
+
+  // Tissue elements of the nodes, aligned with cells, membranes and
+  // apoplasts. Membranes are also listed by orientation, as ranks.
+  std::vector<cell> cell_handles;
+  std::vector<oriented_face> membrane_handles;
+  std::vector<face> apoplast_handles;
+  std::vector<size_t> membranes_pos, membranes_neg;
+
+  TypedAdjacency cell_membranes;       // membranes of each cell
+  std::vector<size_t> membrane_cell;   // cell of each membrane
+  std::vector<size_t> membrane_apoplast;  // apoplast of each membrane
+  TypedAdjacency membrane_membranes;   // neighbor membranes in the same cell
+  TypedAdjacency apoplast_apoplasts;   // neighbor apoplasts
+  TypedAdjacency apoplast_membranes;   // membranes on each side of an apoplast
+
+  // Diffusion coefficients, aligned with the corresponding adjacency
+  std::vector<double> membrane_PIN_diffusion;    // L_m_m/S_m * d_PIN
+  std::vector<double> apoplast_auxin_diffusion;  // S_a_a/V_a * d_a
+  std::vector<double> apoplast_VAF_diffusion;    // S_a_a/V_a * d_VAF
+
+  size_t nbNodes() const { return nodes.size(); }
+
+  // Number of the 5 components of a node of type t which are modelled, the
+  // others stay 0: auxin and PIN in the cells, PIN, APIN, AAUX and VAF in
+  // the membranes, auxin and VAF in the apoplasts
+  static size_t nbComponents(NodeType t)
+  {
+    static const size_t components[3] = { 2, 4, 2 };
+    return components[t];
+  }
+
+  // Number of modelled components of all the nodes
+  size_t nbUnknowns() const
+  {
+    return nbComponents(NT_CELL) * cells.size() + nbComponents(NT_MEMBRANE) * membranes.size()
+      + nbComponents(NT_APOPLAST) * apoplasts.size();
+  }
+  bool empty() const { return nodes.empty(); }
+
+  size_t begin(size_t i) const { return offsets[i]; }
+  size_t end(size_t i) const { return offsets[i+1]; }
+
+  void clear()
+  {
+    nodes.clear();
+    graph_index.clear();
+    type.clear();
+    size.clear();
+    c.clear();
+    dc.clear();
+    coefs.clear();
+    offsets.clear();
+    neighbors.clear();
+    cells.clear();
+    membranes.clear();
+    apoplasts.clear();
+    rank.clear();
+    cell_handles.clear();
+    membrane_handles.clear();
+    apoplast_handles.clear();
+    membranes_pos.clear();
+    membranes_neg.clear();
+    cell_membranes.clear();
+    membrane_cell.clear();
+    membrane_apoplast.clear();
+    membrane_membranes.clear();
+    apoplast_apoplasts.clear();
+    apoplast_membranes.clear();
+    membrane_PIN_diffusion.clear();
+    apoplast_auxin_diffusion.clear();
+    apoplast_VAF_diffusion.clear();
+    coefficients_valid = false;
+    tissue_outdated = false;
+  }
+
+  // Number the nodes of S and copy its topology.
+  // Must be called once the SolverGraph is complete.
+  void build(SolverGraph& S, NodeOrdering ordering = ORDER_RCM)
+  {
+    clear();
+    size_t N = S.size();
+    nodes.reserve(N);
+    type.reserve(N);
+    size.reserve(N);
+    for(const node& n: S) {
+      n->id = nodes.size();
+      nodes.push_back(n);
+      type.push_back(n->type);
+      size.push_back(n->size);
+    }
+    c.resize(N, SolverPoint5(0, 0, 0, 0, 0));
+    dc.resize(N, SolverPoint5(0, 0, 0, 0, 0));
+    stateChanged();
+    coefs.resize(N);
+
+    offsets.resize(N+1);
+    offsets[0] = 0;
+    for(size_t i = 0 ; i < N ; ++i)
+      offsets[i+1] = offsets[i] + S.valence(nodes[i]);
+    neighbors.resize(offsets[N]);
+    for(size_t i = 0 ; i < N ; ++i) {
+      size_t k = offsets[i];
+      for(const node& nn: S.neighbors(nodes[i]))
+        neighbors[k++] = nn->id;
+    }
+    graph_index.resize(N);
+    for(size_t i = 0 ; i < N ; ++i)
+      graph_index[i] = i;
+    if(ordering == ORDER_RCM)
+      renumber(reverseCuthillMcKee());
+
+    buildTypedAdjacency();
+    buildHandles();
+    updateGeometry(S);
+  }
+
+  // Reverse Cuthill-McKee ordering of the nodes: order[k] is the current id
+  // of the node placed at position k. Each connected component is numbered
+  // by a breadth-first search from a pseudo-peripheral node, visiting the
+  // neighbors by increasing degree.
+  std::vector<size_t> reverseCuthillMcKee() const
+  {
+    const size_t N = nbNodes();
+    std::vector<size_t> order;
+    order.reserve(N);
+    std::vector<bool> visited(N, false);
+    std::vector<size_t> level(N, N), queue;
+    for(size_t start = 0 ; start < N ; ++start) {
+      if(visited[start])
+        continue;
+      // Move the root to the node of lowest degree in the last level of the
+      // search, as long as that increases the depth
+      size_t root = start;
+      size_t depth = levels(root, level, queue);
+      for(size_t iter = 0 ; iter < 5 ; ++iter) {
+        size_t candidate = queue.back();
+        for(size_t q = queue.size() ; q > 0 and level[queue[q-1]] == depth ; --q)
+          if(degree(queue[q-1]) <= degree(candidate))
+            candidate = queue[q-1];
+        size_t d = levels(candidate, level, queue);
+        if(d <= depth)
+          break;
+        root = candidate;
+        depth = d;
+      }
+
+      size_t first = order.size();
+      order.push_back(root);
+      visited[root] = true;
+      for(size_t q = first ; q < order.size() ; ++q) {
+        size_t i = order[q];
+        size_t begin_new = order.size();
+        for(size_t k = begin(i) ; k < end(i) ; ++k) {
+          size_t j = neighbors[k];
+          if(not visited[j]) {
+            visited[j] = true;
+            order.push_back(j);
+          }
+        }
+        std::stable_sort(order.begin() + begin_new, order.end(),
+                         [this](size_t a, size_t b) { return degree(a) < degree(b); });
+      }
+    }
+    std::reverse(order.begin(), order.end());
+    return order;
+  }
+
+  size_t degree(size_t i) const { return offsets[i+1] - offsets[i]; }
+
+  // Breadth-first levels from root, the nodes reached are listed in queue
+  // by increasing level. level must be nbNodes() for all the other nodes,
+  // which is restored for the nodes of the previous search. Returns the
+  // largest level.
+  size_t levels(size_t root, std::vector<size_t>& level, std::vector<size_t>& queue) const
+  {
+    const size_t N = nbNodes();
+    for(size_t i: queue)
+      level[i] = N;
+    queue.assign(1, root);
+    level[root] = 0;
+    size_t depth = 0;
+    for(size_t q = 0 ; q < queue.size() ; ++q) {
+      size_t i = queue[q];
+      depth = level[i];
+      for(size_t k = begin(i) ; k < end(i) ; ++k) {
+        size_t j = neighbors[k];
+        if(level[j] == N) {
+          level[j] = level[i] + 1;
+          queue.push_back(j);
+        }
+      }
+    }
+    return depth;
+  }
+
+  // Give the id k to the node of current id order[k]. Only valid before the
+  // typed adjacencies are built.
+  void renumber(const std::vector<size_t>& order)
+  {
+    const size_t N = nbNodes();
+    std::vector<size_t> new_id(N);
+    for(size_t k = 0 ; k < N ; ++k)
+      new_id[order[k]] = k;
+
+    std::vector<node> old_nodes;
+    std::vector<NodeType> old_type;
+    std::vector<double> old_size;
+    std::vector<size_t> old_offsets, old_neighbors, old_index;
+    old_nodes.swap(nodes);
+    old_type.swap(type);
+    old_size.swap(size);
+    old_offsets.swap(offsets);
+    old_neighbors.swap(neighbors);
+    old_index.swap(graph_index);
+
+    nodes.resize(N);
+    type.resize(N);
+    size.resize(N);
+    graph_index.resize(N);
+    offsets.resize(N+1);
+    neighbors.resize(old_neighbors.size());
+    offsets[0] = 0;
+    for(size_t k = 0 ; k < N ; ++k) {
+      size_t i = order[k];
+      nodes[k] = old_nodes[i];
+      nodes[k]->id = k;
+      type[k] = old_type[i];
+      size[k] = old_size[i];
+      graph_index[k] = old_index[i];
+      size_t n = offsets[k];
+      for(size_t l = old_offsets[i] ; l < old_offsets[i+1] ; ++l)
+        neighbors[n++] = new_id[old_neighbors[l]];
+      offsets[k+1] = n;
+    }
+  }
+
+  // Extract the tissue elements from the links, once
+  void buildHandles()
+  {
+    cell_handles.resize(cells.size());
+    for(size_t r = 0 ; r < cells.size() ; ++r)
+      cell_handles[r] = static_cast<CellLink*>(nodes[cells[r]]->link)->cel;
+    membrane_handles.resize(membranes.size());
+    for(size_t r = 0 ; r < membranes.size() ; ++r) {
+      const oriented_face& of = static_cast<MembraneLink*>(nodes[membranes[r]]->link)->membrane;
+      membrane_handles[r] = of;
+      switch(of.orientation()) {
+        case cellflips::pos:
+          membranes_pos.push_back(r);
+          break;
+        case cellflips::neg:
+          membranes_neg.push_back(r);
+          break;
+        default:
+          break;
+      }
+    }
+    apoplast_handles.resize(apoplasts.size());
+    for(size_t r = 0 ; r < apoplasts.size() ; ++r)
+      apoplast_handles[r] = static_cast<ApoplastLink*>(nodes[apoplasts[r]]->link)->apoplast;
+  }
+
+  // Recompute the geometric factors from the sizes of the nodes and the
+  // areas and lengths stored on the edges of S
+  void updateGeometry(SolverGraph& S)
+  {
+    for(size_t i = 0 ; i < nbNodes() ; ++i)
+      size[i] = nodes[i]->size;
+
+    computeRatios(cells, cell_membranes, [this](size_t i, size_t j) {
+                    return size[j] / size[i];   // S_m/V_c
+                  });
+    computeRatios(membranes, membrane_membranes, [this, &S](size_t i, size_t j) {
+                    return S.edge(nodes[i], nodes[j])->length / size[i];   // L_m_m/S_m
+                  });
+    computeRatios(apoplasts, apoplast_apoplasts, [this, &S](size_t i, size_t j) {
+                    return S.edge(nodes[i], nodes[j])->area / size[i];   // S_a_a/V_a
+                  });
+    computeRatios(apoplasts, apoplast_membranes, [this](size_t i, size_t j) {
+                    return size[j] / size[i];   // S_m/V_a
+                  });
+
+    coefficients_valid = false;
+    setDiffusion(d_auxin, d_VAF, d_PIN);
+  }
+
+  // Update the diffusion coefficients, only if they changed
+  void setDiffusion(double d_a, double d_v, double d_p)
+  {
+    if(coefficients_valid and d_a == d_auxin and d_v == d_VAF and d_p == d_PIN)
+      return;
+    d_auxin = d_a;
+    d_VAF = d_v;
+    d_PIN = d_p;
+
+    const std::vector<double>& mm = membrane_membranes.ratio;
+    membrane_PIN_diffusion.resize(mm.size());
+    for(size_t k = 0 ; k < mm.size() ; ++k)
+      membrane_PIN_diffusion[k] = mm[k] * d_PIN;
+
+    const std::vector<double>& aa = apoplast_apoplasts.ratio;
+    apoplast_auxin_diffusion.resize(aa.size());
+    apoplast_VAF_diffusion.resize(aa.size());
+    for(size_t k = 0 ; k < aa.size() ; ++k) {
+      apoplast_auxin_diffusion[k] = aa[k] * d_auxin;
+      apoplast_VAF_diffusion[k] = aa[k] * d_VAF;
+    }
+    coefficients_valid = true;
+    transport_version++;
+  }
+
+  template <typename F>
+  void computeRatios(const std::vector<size_t>& ids, TypedAdjacency& adj, const F& f)
+  {
+    adj.ratio.resize(adj.ids.size());
+    for(size_t r = 0 ; r < ids.size() ; ++r)
+      for(size_t k = adj.begin(r) ; k < adj.end(r) ; ++k)
+        adj.ratio[k] = f(ids[r], adj.ids[k]);
+  }
+
+  // Split the CSR neighborhoods by node type
+  void buildTypedAdjacency()
+  {
+    size_t N = nbNodes();
+    rank.resize(N);
+    for(size_t i = 0 ; i < N ; ++i) {
+      switch(type[i]) {
+        case NT_CELL:
+          rank[i] = cells.size();
+          cells.push_back(i);
+          break;
+        case NT_MEMBRANE:
+          rank[i] = membranes.size();
+          membranes.push_back(i);
+          break;
+        case NT_APOPLAST:
+          rank[i] = apoplasts.size();
+          apoplasts.push_back(i);
+          break;
+      }
+    }
+
+    selectNeighbors(cells, NT_MEMBRANE, cell_membranes);
+    selectNeighbors(membranes, NT_MEMBRANE, membrane_membranes);
+    selectNeighbors(apoplasts, NT_APOPLAST, apoplast_apoplasts);
+    selectNeighbors(apoplasts, NT_MEMBRANE, apoplast_membranes);
+
+    membrane_cell.resize(membranes.size());
+    membrane_apoplast.resize(membranes.size());
+    for(size_t r = 0 ; r < membranes.size() ; ++r) {
+      size_t i = membranes[r];
+      for(size_t k = begin(i) ; k < end(i) ; ++k) {
+        size_t j = neighbors[k];
+        if(type[j] == NT_CELL)
+          membrane_cell[r] = j;
+        else if(type[j] == NT_APOPLAST)
+          membrane_apoplast[r] = j;
+      }
+    }
+  }
+
+  // Extract, for each node of ids, the neighbors of type t
+  void selectNeighbors(const std::vector<size_t>& ids, NodeType t, TypedAdjacency& adj)
+  {
+    adj.offsets.resize(ids.size()+1);
+    adj.offsets[0] = 0;
+    adj.ids.clear();
+    for(size_t r = 0 ; r < ids.size() ; ++r) {
+      size_t i = ids[r];
+      for(size_t k = begin(i) ; k < end(i) ; ++k)
+        if(type[neighbors[k]] == t)
+          adj.ids.push_back(neighbors[k]);
+      adj.offsets[r+1] = adj.ids.size();
+    }
+  }
+
+  // Read the concentrations from the tissue
+  void read()
+  {
+    for(size_t r = 0 ; r < cells.size() ; ++r) {
+      const cell& cel = cell_handles[r];
+      SolverPoint5& ci = c[cells[r]];
+      SolverPoint5& dci = dc[cells[r]];
+      ci[AUXIN] = cel->auxin;
+      ci[PIN] = cel->PIN;
+      dci[AUXIN] = cel->dauxin;
+      dci[PIN] = cel->dPIN;
+    }
+    for(size_t r: membranes_pos) {
+      const oriented_face& m = membrane_handles[r];
+      SolverPoint5& ci = c[membranes[r]];
+      SolverPoint5& dci = dc[membranes[r]];
+      ci[PIN] = m->PINpos;
+      ci[APIN] = m->APINpos;
+      ci[AAUX] = m->AAUXpos;
+      ci[VAF] = m->VAFpos;
+      dci[PIN] = m->dPINpos;
+      dci[APIN] = m->dAPINpos;
+      dci[AAUX] = m->dAAUXpos;
+      dci[VAF] = m->dVAFpos;
+    }
+    for(size_t r: membranes_neg) {
+      const oriented_face& m = membrane_handles[r];
+      SolverPoint5& ci = c[membranes[r]];
+      SolverPoint5& dci = dc[membranes[r]];
+      ci[PIN] = m->PINneg;
+      ci[APIN] = m->APINneg;
+      ci[AAUX] = m->AAUXneg;
+      ci[VAF] = m->VAFneg;
+      dci[PIN] = m->dPINneg;
+      dci[APIN] = m->dAPINneg;
+      dci[AAUX] = m->dAAUXneg;
+      dci[VAF] = m->dVAFneg;
+    }
+    for(size_t r = 0 ; r < apoplasts.size() ; ++r) {
+      const face& f = apoplast_handles[r];
+      SolverPoint5& ci = c[apoplasts[r]];
+      SolverPoint5& dci = dc[apoplasts[r]];
+      ci[AUXIN] = f->auxin;
+      ci[VAF] = f->VAF;
+      dci[AUXIN] = f->dauxin;
+      dci[VAF] = f->dVAF;
+    }
+    tissue_outdated = false;
+    stateChanged();
+  }
+
+  // Write the concentrations back into the tissue
+  void apply()
+  {
+    for(size_t r = 0 ; r < cells.size() ; ++r) {
+      const cell& cel = cell_handles[r];
+      const SolverPoint5& ci = c[cells[r]];
+      const SolverPoint5& dci = dc[cells[r]];
+      cel->auxin = ci[AUXIN];
+      cel->PIN = ci[PIN];
+      cel->dauxin = dci[AUXIN];
+      cel->dPIN = dci[PIN];
+    }
+    for(size_t r: membranes_pos) {
+      const oriented_face& m = membrane_handles[r];
+      const SolverPoint5& ci = c[membranes[r]];
+      const SolverPoint5& dci = dc[membranes[r]];
+      m->PINpos = ci[PIN];
+      m->APINpos = ci[APIN];
+      m->AAUXpos = ci[AAUX];
+      m->VAFpos = ci[VAF];
+      m->dPINpos = dci[PIN];
+      m->dAPINpos = dci[APIN];
+      m->dAAUXpos = dci[AAUX];
+      m->dVAFpos = dci[VAF];
+    }
+    for(size_t r: membranes_neg) {
+      const oriented_face& m = membrane_handles[r];
+      const SolverPoint5& ci = c[membranes[r]];
+      const SolverPoint5& dci = dc[membranes[r]];
+      m->PINneg = ci[PIN];
+      m->APINneg = ci[APIN];
+      m->AAUXneg = ci[AAUX];
+      m->VAFneg = ci[VAF];
+      m->dPINneg = dci[PIN];
+      m->dAPINneg = dci[APIN];
+      m->dAAUXneg = dci[AAUX];
+      m->dVAFneg = dci[VAF];
+    }
+    for(size_t r = 0 ; r < apoplasts.size() ; ++r) {
+      const face& f = apoplast_handles[r];
+      const SolverPoint5& ci = c[apoplasts[r]];
+      const SolverPoint5& dci = dc[apoplasts[r]];
+      f->auxin = ci[AUXIN];
+      f->VAF = ci[VAF];
+      f->dauxin = dci[AUXIN];
+      f->dVAF = dci[VAF];
+    }
+    tissue_outdated = false;
+  }
+
+  // To be called when the solver modified the arrays
+  void invalidateTissue() { tissue_outdated = true; }
+
+  // To be called when c is written outside of the native solver
+  void stateChanged() { state_version++; }
+
+  // Write the concentrations into the tissue if they changed since the last
+  // synchronisation. Must be called before anything reads the tissue.
+  void syncTissue()
+  {
+    if(tissue_outdated)
+      apply();
+  }
+
+  // diffusion coefficients used for the current transport coefficients
+  double d_auxin = 0, d_VAF = 0, d_PIN = 0;
+  bool coefficients_valid = false;
+  size_t transport_version = 0;  // incremented when the transport coefficients change
+  size_t state_version = 0;      // incremented when the concentrations change
+  bool tissue_outdated = false;  // the tissue is older than the arrays
+};
+
+#endif // COMPILED_GRAPH_H
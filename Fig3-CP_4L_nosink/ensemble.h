@@ -0,0 +1,382 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <util/parms.h>
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "compiled_graph.h"
+#include "native_ops.h"
+#include "fast_math.h"
+#include "kinetics.h"
+
+using cellflips::out;
+
+// Number of parameter sets integrated together, the width of Lanes. Best
+// set to a multiple of the SIMD width of the target (4 doubles for AVX2).
+#ifndef ENSEMBLE_LANES
+#  define ENSEMBLE_LANES 4
+#endif
+
+// One value per parameter set. The arithmetic is element-wise and written
+// as short loops the compiler vectorises, so a kernel instantiated with
+// Lanes in place of double evaluates all the parameter sets at once.
+struct Lanes
+{
+  double v[ENSEMBLE_LANES];
+
+  Lanes() {}
+
+  Lanes(double x)
+  {
+#pragma omp simd
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+      v[l] = x;
+  }
+
+  Lanes& operator+=(const Lanes& x)
+  {
+#pragma omp simd
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+      v[l] += x.v[l];
+    return *this;
+  }
+
+  Lanes& operator-=(const Lanes& x)
+  {
+#pragma omp simd
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+      v[l] -= x.v[l];
+    return *this;
+  }
+
+  Lanes& operator*=(const Lanes& x)
+  {
+#pragma omp simd
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+      v[l] *= x.v[l];
+    return *this;
+  }
+
+  Lanes& operator/=(const Lanes& x)
+  {
+#pragma omp simd
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+      v[l] /= x.v[l];
+    return *this;
+  }
+
+  Lanes operator-() const
+  {
+    Lanes y;
+#pragma omp simd
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+      y.v[l] = -v[l];
+    return y;
+  }
+};
+
+inline Lanes operator+(Lanes x, const Lanes& y) { return x += y; }
+inline Lanes operator-(Lanes x, const Lanes& y) { return x -= y; }
+inline Lanes operator*(Lanes x, const Lanes& y) { return x *= y; }
+inline Lanes operator/(Lanes x, const Lanes& y) { return x /= y; }
+
+// Found by argument dependent lookup from the kernels, see Kinetics
+inline Lanes exp(const Lanes& x)
+{
+  Lanes y;
+#pragma omp simd
+  for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+    y.v[l] = fast_math::exp(x.v[l]);
+  return y;
+}
+
+inline Lanes log(const Lanes& x)
+{
+  Lanes y;
+  for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+    y.v[l] = std::log(x.v[l]);
+  return y;
+}
+
+// Concentrations of a node for all the parameter sets, used as Point5d
+struct LanePoint5
+{
+  Lanes v[5];
+
+  LanePoint5() {}
+
+  LanePoint5(const Lanes& a, const Lanes& b, const Lanes& c, const Lanes& d, const Lanes& e)
+  {
+    v[0] = a;
+    v[1] = b;
+    v[2] = c;
+    v[3] = d;
+    v[4] = e;
+  }
+
+  Lanes& operator[](size_t i) { return v[i]; }
+  const Lanes& operator[](size_t i) const { return v[i]; }
+};
+
+template <>
+struct Point5Of<Lanes>
+{
+  typedef LanePoint5 type;
+};
+
+// Explicit integrators advancing the ENSEMBLE_LANES parameter sets together
+// on the topology of a CompiledGraph.
+//
+// They are selected with the `Solver' key and read the parameters of the
+// corresponding native solvers (ParallelEuler, ParallelRungeKutta and
+// ParallelAdaptiveEuler). The adaptive step is shared: it is controlled by
+// the largest error over the parameter sets, except the ones excluded with
+// setControlled (e.g. finished, or repeating another set). The model must
+// provide
+//
+//   void computeDerivatives(const std::vector<LanePoint5>& c, std::vector<LanePoint5>& dc);
+class EnsembleSolver
+{
+public:
+  typedef std::vector<LanePoint5> State;
+
+  enum Method
+  {
+    EULER,
+    RUNGE_KUTTA,
+    ADAPTIVE_EULER
+  };
+
+  EnsembleSolver()
+    : method(ADAPTIVE_EULER)
+    , dt(0)
+    , fsal(false)
+  {
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l)
+      controlled[l] = true;
+  }
+
+  void readParms(util::Parms& parms, const QString& section)
+  {
+    QString name;
+    parms(section, "Solver", name);
+    if(name == "ParallelEuler")
+      method = EULER;
+    else if(name == "ParallelRungeKutta")
+      method = RUNGE_KUTTA;
+    else if(name == "ParallelAdaptiveEuler")
+      method = ADAPTIVE_EULER;
+    else {
+      out << "Ensemble runs use ParallelEuler, ParallelRungeKutta or "
+          << "ParallelAdaptiveEuler, using ParallelAdaptiveEuler in place of '"
+          << name << "'" << endl;
+      method = ADAPTIVE_EULER;
+    }
+
+    parms(section, "EulerDt", euler_dt);
+    parms(section, "RungeKuttaDt", runge_kutta_dt);
+    parms(section, "InitialDt", initial_dt);
+    parms(section, "MaxDt", max_dt);
+
+    parms(section, "AEulerIncDt", aeuler.inc_dt);
+    parms(section, "AEulerResDt", aeuler.res_dt);
+    parms(section, "AEulerMinDt", aeuler.min_dt);
+    parms(section, "AEulerMaxDt", aeuler.max_dt);
+    native::readTolType(parms, section, "AEulerTolType", aeuler.tol_type);
+    parms(section, "AEulerResTol", aeuler.res_tol);
+    parms(section, "AEulerLowTol", aeuler.low_tol);
+    parms(section, "AEulerHighTol", aeuler.high_tol);
+
+    next_dt = std::min(initial_dt, max_dt);
+    reset();
+  }
+
+  // Must be called when the derivatives of the current state may have
+  // changed outside of the solver
+  void reset()
+  {
+    fsal = false;
+  }
+
+  // Set all the parameter sets to the concentrations of G
+  void setState(const CompiledGraph& G)
+  {
+    const std::vector<SolverPoint5>& x = G.c;
+    const long N = x.size();
+    unknowns = G.nbUnknowns();
+    c.resize(N);
+    dc.resize(N);
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      for(size_t a = 0 ; a < 5 ; ++a)
+        c[i][a] = Lanes(x[i][a]);
+    reset();
+  }
+
+  // Set whether the error of parameter set l controls the shared step. The
+  // sets which are not controlled are still integrated.
+  void setControlled(size_t l, bool control)
+  {
+    controlled[l] = control;
+  }
+
+  // Copy the concentrations and derivatives of parameter set l
+  void getLane(size_t l, std::vector<SolverPoint5>& x, std::vector<SolverPoint5>& dx) const
+  {
+    const long N = c.size();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      for(size_t a = 0 ; a < 5 ; ++a) {
+        x[i][a] = c[i][a].v[l];
+        dx[i][a] = dc[i][a].v[l];
+      }
+  }
+
+  // Advance all the parameter sets by one step, dt is set to its size
+  template <typename Model>
+  void operator()(Model& model)
+  {
+    if(not fsal) {
+      model.computeDerivatives(c, dc);
+      fsal = true;
+    }
+    switch(method) {
+      case EULER:
+        dt = euler_dt;
+        axpy(c, c, dt, dc);
+        model.computeDerivatives(c, dc);
+        break;
+      case RUNGE_KUTTA:
+        rungeKutta(model);
+        break;
+      case ADAPTIVE_EULER:
+        adaptiveEuler(model);
+        break;
+    }
+  }
+
+  Method method;
+  double dt;                 // size of the last step taken
+  State c, dc;               // concentrations and derivatives, by node id
+
+protected:
+  // y = x + a*v
+  static void axpy(State& y, const State& x, double a, const State& v)
+  {
+    const long N = x.size();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      for(size_t k = 0 ; k < 5 ; ++k)
+        y[i][k] = x[i][k] + a * v[i][k];
+  }
+
+  // Largest norm of e over the controlled parameter sets
+  double errorNorm(const State& e, native::TolType type) const
+  {
+    double result = 0;
+    for(size_t l = 0 ; l < ENSEMBLE_LANES ; ++l) {
+      if(not controlled[l])
+        continue;
+      double norm;
+      if(type == native::MAX_COMPONENT)
+        norm = native::maxReduce(e.size(), [&e, l](size_t i) {
+                                   double m = 0;
+                                   for(size_t k = 0 ; k < 5 ; ++k)
+                                     m = std::max(m, std::abs(e[i][k].v[l]));
+                                   return m;
+                                 });
+      else if(type == native::WEIGHTED_RMS) {
+        // without per chemical weights, as native::errorNorm, over the
+        // modelled components
+        norm = native::sumReduce(e.size(), [&e, l](size_t i) {
+                                   double m = 0;
+                                   for(size_t k = 0 ; k < 5 ; ++k)
+                                     m += e[i][k].v[l] * e[i][k].v[l];
+                                   return m;
+                                 });
+        norm = std::sqrt(norm / std::max<size_t>(unknowns, 1));
+      } else {
+        norm = native::sumReduce(e.size(), [&e, l](size_t i) {
+                                   double m = 0;
+                                   for(size_t k = 0 ; k < 5 ; ++k)
+                                     m += std::abs(e[i][k].v[l]);
+                                   return m;
+                                 });
+        norm /= std::max<size_t>(unknowns, 1);
+      }
+      // also catches a NaN in one of the parameter sets
+      if(not (norm <= result))
+        result = norm;
+    }
+    return result;
+  }
+
+  template <typename Model>
+  void rungeKutta(Model& model)
+  {
+    const long N = c.size();
+    y.resize(N);
+    k1.resize(N);
+    k2.resize(N);
+    k3.resize(N);
+    dt = runge_kutta_dt;
+    axpy(y, c, dt/2, dc);
+    model.computeDerivatives(y, k1);
+    axpy(y, c, dt/2, k1);
+    model.computeDerivatives(y, k2);
+    axpy(y, c, dt, k2);
+    model.computeDerivatives(y, k3);
+    const double h = dt;
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      for(size_t a = 0 ; a < 5 ; ++a)
+        c[i][a] += h/6 * dc[i][a] + h/3 * k1[i][a] + h/3 * k2[i][a] + h/6 * k3[i][a];
+    model.computeDerivatives(c, dc);
+  }
+
+  // Euler step, the error is estimated from the difference with Heun's
+  // method, as for the native solver
+  template <typename Model>
+  void adaptiveEuler(Model& model)
+  {
+    const long N = c.size();
+    y.resize(N);
+    k1.resize(N);
+    k2.resize(N);
+    while(true) {
+      double h = next_dt;
+      axpy(y, c, h, dc);
+      model.computeDerivatives(y, k1);
+      axpy(k2, k1, -1, dc);
+      double err = h/2 * errorNorm(k2, aeuler.tol_type);
+      if(not (err <= aeuler.res_tol) and h > aeuler.min_dt) {
+        next_dt = std::max(h * aeuler.res_dt, aeuler.min_dt);
+        continue;
+      }
+      dt = h;
+      std::swap(c, y);
+      std::swap(dc, k1);
+      next_dt = aeuler.adapt(h, err);
+      break;
+    }
+  }
+
+  double euler_dt = .01;
+  double runge_kutta_dt = .01;
+  double initial_dt = .01;
+  double max_dt = 1;
+  native::AdaptiveParms aeuler;
+
+  double next_dt = .01;
+  bool fsal;
+  bool controlled[ENSEMBLE_LANES];  // the error of the set controls the step
+  size_t unknowns = 0;              // modelled components of the graph
+  State y, k1, k2, k3;
+};
+
+#endif // ENSEMBLE_H
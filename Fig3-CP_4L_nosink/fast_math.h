@@ -0,0 +1,68 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <cstdint>
+#include <cstring>
+
+// Branch-free exponential which the compiler can vectorise, used for the
+// transcendental terms of the derivative evaluation.
+//
+// The argument is reduced as x = n*ln(2) + r with |r| <= ln(2)/2, e^r is
+// evaluated with its Taylor polynomial of degree 13 and the result is scaled
+// by 2^n by building the exponent bits. The truncation error is below
+// 1.7e-16 relative and the result is within 1 ulp of std::exp (relative
+// error < 2.3e-16, checked on 5e6 random arguments) for x in [-708, 709].
+// Arguments outside of this range are clamped to it, so the result never
+// overflows to inf nor underflows to 0.
+//
+// Must not be compiled with -ffast-math, which would break the rounding
+// trick. GCC only vectorises the clamping with -fno-trapping-math.
+namespace fast_math
+{
+const double EXP_MIN_ARG = -708.;
+const double EXP_MAX_ARG = 709.;
+
+#pragma omp declare simd
+inline double exp(double x)
+{
+  const double log2e = 1.4426950408889634;
+  const double ln2_hi = 6.93147180369123816490e-01;
+  const double ln2_lo = 1.90821492927058770002e-10;
+
+  x = x < EXP_MIN_ARG ? EXP_MIN_ARG : x;
+  x = x > EXP_MAX_ARG ? EXP_MAX_ARG : x;
+
+  // n = round(x / ln(2)): adding 1.5*2^52 rounds to an integer, which is
+  // then found in the low bits of the mantissa of s
+  const double shifter = 6755399441055744.;
+  double s = x * log2e + shifter;
+  double n = s - shifter;
+  double r = (x - n * ln2_hi) - n * ln2_lo;
+
+  double p = 1./6227020800.;
+  p = p * r + 1./479001600.;
+  p = p * r + 1./39916800.;
+  p = p * r + 1./3628800.;
+  p = p * r + 1./362880.;
+  p = p * r + 1./40320.;
+  p = p * r + 1./5040.;
+  p = p * r + 1./720.;
+  p = p * r + 1./120.;
+  p = p * r + 1./24.;
+  p = p * r + 1./6.;
+  p = p * r + .5;
+  p = p * r + 1.;
+  p = p * r + 1.;
+
+  // 2^n, n is in [-1021, 1023]
+  int64_t bits;
+  std::memcpy(&bits, &s, sizeof(double));
+  bits = (bits - (int64_t)0x4338000000000000LL + 1023) << 52;
+  double scale;
+  std::memcpy(&scale, &bits, sizeof(double));
+  return p * scale;
+}
+
+} // namespace fast_math
+
+#endif // FAST_MATH_H
@@ -0,0 +1,190 @@
+#ifndef GRAPH_COLORING_H
+#define GRAPH_COLORING_H
+
+#include <util/parms.h>
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "compiled_graph.h"
+#include "native_ops.h"
+#include "block_matrix.h"
+
+using cellflips::out;
+
+// Distance-2 coloring of a CompiledGraph: two nodes sharing a neighbor, or
+// neighbors of each other, never have the same color.
+//
+// The derivatives of a node only depend on the node and its neighbors, so
+// the columns of the Jacobian of the nodes of one color never contribute to
+// the same row. Perturbing all of them at once gives, in a single derivative
+// evaluation, one column of each of them.
+struct GraphColoring
+{
+  std::vector<size_t> color;    // color of each node
+  std::vector<size_t> offsets;  // first node of each color in ids, nbColors()+1 elements
+  std::vector<size_t> ids;      // nodes, sorted by color
+
+  size_t nbColors() const { return offsets.empty() ? 0 : offsets.size() - 1; }
+  size_t begin(size_t k) const { return offsets[k]; }
+  size_t end(size_t k) const { return offsets[k+1]; }
+
+  // Greedy coloring in the order of the nodes, each node gets the smallest
+  // color not used within distance 2. Uses at most (max degree)^2 + 1
+  // colors, and about max degree + 1 on the graphs of the tissue.
+  void compute(const CompiledGraph& G)
+  {
+    const size_t N = G.nbNodes();
+    const size_t NONE = N;
+    color.assign(N, NONE);
+    std::vector<size_t> forbidden;  // node which forbade each color last
+    size_t nb_colors = 0;
+    for(size_t i = 0 ; i < N ; ++i) {
+      for(size_t k = G.begin(i) ; k < G.end(i) ; ++k) {
+        size_t j = G.neighbors[k];
+        if(color[j] != NONE)
+          forbidden[color[j]] = i;
+        for(size_t l = G.begin(j) ; l < G.end(j) ; ++l) {
+          size_t m = G.neighbors[l];
+          if(m != i and color[m] != NONE)
+            forbidden[color[m]] = i;
+        }
+      }
+      size_t c = 0;
+      while(c < nb_colors and forbidden[c] == i)
+        ++c;
+      if(c == nb_colors) {
+        ++nb_colors;
+        forbidden.push_back(NONE);
+      }
+      color[i] = c;
+    }
+
+    offsets.assign(nb_colors+1, 0);
+    for(size_t i = 0 ; i < N ; ++i)
+      offsets[color[i]+1]++;
+    for(size_t k = 0 ; k < nb_colors ; ++k)
+      offsets[k+1] += offsets[k];
+    ids.resize(N);
+    std::vector<size_t> pos(offsets.begin(), offsets.end() - 1);
+    for(size_t i = 0 ; i < N ; ++i)
+      ids[pos[color[i]]++] = i;
+  }
+};
+
+// Jacobian of the derivatives by compressed finite differences.
+//
+// For each color and each chemical, the chemical of all the nodes of the
+// color is perturbed by dx and the derivatives are evaluated once, so the
+// whole Jacobian costs 5 * nbColors() evaluations instead of 5 per node.
+// The model must provide computeDerivatives for double states.
+class ColoredJacobian
+{
+public:
+  // Needs to be called again if G is rebuilt
+  void setStructure(const CompiledGraph& G)
+  {
+    coloring.compute(G);
+  }
+
+  // Fill J, which must have the structure of G, with the Jacobian at c. fc
+  // must hold the derivatives at c. Returns the number of derivative
+  // evaluations.
+  template <typename Model>
+  size_t operator()(Model& model, const native::State& c, const native::State& fc, BlockMatrix& J)
+  {
+    const long N = c.size();
+    y = c;
+    fy.resize(N);
+    block_color.resize(J.columns.size());
+    for(size_t k = 0 ; k < J.columns.size() ; ++k)
+      block_color[k] = coloring.color[J.columns[k]];
+    const double h = dx;
+    for(size_t col = 0 ; col < coloring.nbColors() ; ++col) {
+      const long first = coloring.begin(col), last = coloring.end(col);
+      for(size_t b = 0 ; b < 5 ; ++b) {
+#pragma omp parallel for schedule(static)
+        for(long r = first ; r < last ; ++r)
+          y[coloring.ids[r]][b] += h;
+        model.computeDerivatives(y, fy);
+#pragma omp parallel for schedule(static)
+        for(long r = first ; r < last ; ++r)
+          y[coloring.ids[r]][b] = c[coloring.ids[r]][b];
+        // each row has at most one block of this color
+#pragma omp parallel for schedule(static)
+        for(long i = 0 ; i < N ; ++i)
+          for(size_t k = J.begin(i) ; k < J.end(i) ; ++k)
+            if(block_color[k] == col) {
+              for(size_t a = 0 ; a < 5 ; ++a)
+                J.blocks[k].v[a][b] = (fy[i][a] - fc[i][a]) / h;
+              break;
+            }
+      }
+    }
+    return 5 * coloring.nbColors();
+  }
+
+  size_t nbColors() const { return coloring.nbColors(); }
+
+  double dx = 1e-6;         // perturbation of the concentrations
+
+protected:
+  GraphColoring coloring;
+  std::vector<size_t> block_color;
+  native::State y, fy;
+};
+
+// Source of the Jacobian of the implicit native solvers, selected with the
+// `Jacobian' key: Analytic (computeJacobian of the model) or ColoredFD
+// (ColoredJacobian, with the `Dx' perturbation of the RDSolver).
+class JacobianEvaluator
+{
+public:
+  enum Method
+  {
+    ANALYTIC,
+    COLORED_FD
+  };
+
+  void readParms(util::Parms& parms, const QString& section)
+  {
+    QString name;
+    if(parms(section, "Jacobian", name)) {
+      if(name == "Analytic")
+        method = ANALYTIC;
+      else if(name == "ColoredFD")
+        method = COLORED_FD;
+      else
+        out << "Error, unknown Jacobian '" << name << "', using Analytic" << endl;
+    }
+    parms(section, "Dx", fd.dx);
+  }
+
+  // Fill J with the Jacobian at c, where the derivatives are fc. Returns the
+  // number of derivative evaluations.
+  template <typename Model>
+  size_t operator()(const CompiledGraph& G, Model& model, const native::State& c,
+                    const native::State& fc, BlockMatrix& J)
+  {
+    if(method == ANALYTIC) {
+      model.computeJacobian(c, J);
+      return 0;
+    }
+    if(fd.nbColors() == 0 or colored_nodes != G.nbNodes()) {
+      fd.setStructure(G);
+      colored_nodes = G.nbNodes();
+    }
+    return fd(model, c, fc, J);
+  }
+
+  Method method = ANALYTIC;
+  ColoredJacobian fd;
+
+protected:
+  size_t colored_nodes = 0;
+};
+
+#endif // GRAPH_COLORING_H
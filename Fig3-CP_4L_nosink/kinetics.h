@@ -0,0 +1,119 @@
+#ifndef KINETICS_H
+#define KINETICS_H
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+
+#include "compiled_graph.h"
+#include "fast_math.h"
+
+// Rate constants of the reactions, and the per node terms derived from them,
+// as used by the derivative kernels of the model.
+//
+// Real is double for a single simulation, or a vector of values (see Lanes
+// in ensemble.h) to evaluate several parameter sets at once. The transport
+// and production coefficients are not part of it: they are baked into the
+// CompiledGraph and shared by all the parameter sets.
+template <typename Real>
+struct Kinetics
+{
+  Real T_in1, T_in2, T_out1, T_out2;      // AUX/LAX and PIN activation, transport
+  Real kappa_p;                           // PIN production saturation
+  Real sigma_p, kappa_p_m, sigma_apin, sigma_aaux, mu_p; // PIN exo/endocytosis
+  Real nu_apin_low, nu_apin_high, nu_apin_slope, a_th;   // APIN breakup
+  Real k_b, k_u, mu_VAF;                  // VAF binding and turnover
+  Real b_VAF;                             // base of the VAF effect
+  Real log_b_VAF;                         // log(b_VAF), see update()
+
+  std::vector<Real> PIN_production;  // 1, or 0 if the cell has PIN in excess, by rank
+  std::vector<Real> nu_apin;         // APIN breakup rate of each cell, by rank
+  std::vector<Real> VAF_effect;      // b_VAF^VAF of each membrane, by rank
+
+  // Size the per node arrays for G, needs to be called again if G is rebuilt
+  void resize(const CompiledGraph& G)
+  {
+    PIN_production.resize(G.cells.size(), Real(1.));
+    nu_apin.resize(G.cells.size());
+    VAF_effect.resize(G.membranes.size());
+  }
+
+  // Must be called when the rate constants are modified
+  void update()
+  {
+    using std::log;
+    log_b_VAF = log(b_VAF);
+  }
+
+  // The exponentials are found by argument dependent lookup for types other
+  // than double, see ensemble.h
+
+  // APIN breakup rate of a cell, sigmoid of its auxin concentration
+  Real APINBreakupRate(const Real& auxin) const
+  {
+    using fast_math::exp;
+    return nu_apin_low + (nu_apin_high - nu_apin_low) / (1. + exp(-nu_apin_slope * (auxin - a_th)));
+  }
+
+  // Derivative of APINBreakupRate with respect to the auxin concentration
+  Real APINBreakupRateDerivative(const Real& auxin) const
+  {
+    using fast_math::exp;
+    Real s = 1. / (1. + exp(-nu_apin_slope * (auxin - a_th)));
+    return (nu_apin_high - nu_apin_low) * nu_apin_slope * s * (1. - s);
+  }
+
+  // Effect of VAF on the PIN exocytosis of a membrane, b_VAF^VAF
+  Real VAFEffect(const Real& VAF) const
+  {
+    using fast_math::exp;
+    return exp(log_b_VAF * VAF);
+  }
+};
+
+// Concentrations of a node in the precision Real, used by the kernels to
+// accumulate the derivatives before storing them
+template <typename Real>
+struct Point5Of
+{
+  typedef util::Vector<5,Real> type;
+};
+
+// Rate constant of k with the name of its key in the [CellChemicals] section
+// of view.v, or 0 if there is none
+template <typename Real>
+Real* kineticParameter(Kinetics<Real>& k, const QString& name)
+{
+  if(name == "AAUXFormation") return &k.T_in1;
+  if(name == "InfluxByAAUX") return &k.T_in2;
+  if(name == "APINFormation") return &k.T_out1;
+  if(name == "EffluxByAPIN") return &k.T_out2;
+  if(name == "PINProductionSaturation") return &k.kappa_p;
+  if(name == "PINExocytosisConstitutive") return &k.sigma_p;
+  if(name == "PINMembraneSaturation") return &k.kappa_p_m;
+  if(name == "PINExocytosisAPIN") return &k.sigma_apin;
+  if(name == "PINExocytosisAAUX") return &k.sigma_aaux;
+  if(name == "PINEndocytosisConstitutive") return &k.mu_p;
+  if(name == "APINBreakupLow") return &k.nu_apin_low;
+  if(name == "APINBreakupHigh") return &k.nu_apin_high;
+  if(name == "APINBreakupSlope") return &k.nu_apin_slope;
+  if(name == "AuxinThreshold") return &k.a_th;
+  if(name == "VAFBinding") return &k.k_b;
+  if(name == "VAFUnbinding") return &k.k_u;
+  if(name == "VAFTurnover") return &k.mu_VAF;
+  if(name == "ExpBasePINRelocation") return &k.b_VAF;
+  return 0;
+}
+
+// Names accepted by kineticParameter
+static const char* const KINETIC_PARAMETERS[] = {
+  "AAUXFormation", "InfluxByAAUX", "APINFormation", "EffluxByAPIN",
+  "PINProductionSaturation", "PINExocytosisConstitutive",
+  "PINMembraneSaturation", "PINExocytosisAPIN", "PINExocytosisAAUX",
+  "PINEndocytosisConstitutive", "APINBreakupLow", "APINBreakupHigh",
+  "APINBreakupSlope", "AuxinThreshold", "VAFBinding", "VAFUnbinding",
+  "VAFTurnover", "ExpBasePINRelocation"
+};
+
+#endif // KINETICS_H
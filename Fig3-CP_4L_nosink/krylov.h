@@ -0,0 +1,444 @@
+#ifndef KRYLOV_H
+#define KRYLOV_H
+
+#include <util/parms.h>
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+
+#include "native_ops.h"
+#include "block_matrix.h"
+
+// Iterative solvers for the linear systems of the implicit native solvers.
+//
+// The matrix is given as an operator A(x, y) computing y = A x, so the same
+// solvers work on assembled and implicit matrices. Convergence is tested
+// with the TolType of the RDSolver on the residual b - A x, never on the
+// preconditioned one: BiCGStab and GMRES are preconditioned on the right,
+// and the conjugate gradient only applies the preconditioner to the
+// search directions. The conjugate gradient and BiCGStab test the residual
+// updated along the iterations, GMRES the true residual at each restart.
+namespace krylov
+{
+typedef native::State State;
+
+enum Method
+{
+  CONJUGATE_GRADIENT,
+  BICGSTAB,
+  GMRES
+};
+
+struct Parms
+{
+  Method method = CONJUGATE_GRADIENT;
+  double tol = 1e-5;
+  native::TolType tol_type = native::MAX_COMPONENT;
+  double max_steps = .1;      // maximum number of iterations, multiple of N
+  size_t min_max_steps = 10;  // lower bound on the maximum number of iterations
+  int restart = 30;           // size of the Krylov space of GMRES
+  size_t unknowns = 0;        // modelled components for the norms, 5 N if 0
+
+  size_t maxSteps(size_t N) const
+  {
+    return std::max(min_max_steps, size_t(max_steps * 5 * N));
+  }
+
+  // Bound on the 2-norm of the residual ensuring convergence for tol_type
+  double twoNormTol(size_t N) const
+  {
+    if(tol_type != native::MAX_COMPONENT)
+      return tol * std::sqrt(double(unknowns > 0 ? unknowns : 5 * N));
+    return tol;
+  }
+};
+
+struct Result
+{
+  size_t iterations = 0;
+  bool converged = false;
+};
+
+// Work vectors of the solvers. The caller keeps it between the solves, so
+// the vectors are only allocated when the size of the system changes.
+struct Workspace
+{
+  std::vector<State> vectors;
+
+  // The n first work vectors, of size N
+  State* get(size_t n, size_t N)
+  {
+    if(vectors.size() < n)
+      vectors.resize(n);
+    for(size_t k = 0 ; k < n ; ++k)
+      vectors[k].resize(N);
+    return &vectors[0];
+  }
+};
+
+inline bool readMethod(util::Parms& parms, const QString& section, const QString& key, Method& method)
+{
+  QString name;
+  if(not parms(section, key, name))
+    return false;
+  if(name == "ConjugateGradient")
+    method = CONJUGATE_GRADIENT;
+  else if(name == "BiCGStab")
+    method = BICGSTAB;
+  else if(name == "GMRES")
+    method = GMRES;
+  else {
+    out << "Error, unknown linear solver '" << name << "' for " << key << endl;
+    return false;
+  }
+  return true;
+}
+
+// Preconditioners built from the assembled block matrix of the system.
+//
+// BLOCK_JACOBI inverts the 5x5 diagonal block of each node, which holds the
+// fast local kinetics (PIN cycling and APIN/AAUX binding on the membranes).
+// ILU0 is the incomplete block LU factorisation with the sparsity of the
+// graph, which also captures the cell-membrane-apoplast transport. Its
+// factorisation and triangular solves are sequential.
+class Preconditioner
+{
+public:
+  enum Type
+  {
+    NONE,
+    BLOCK_JACOBI,
+    ILU0
+  };
+
+  Type type = NONE;
+
+  bool read(util::Parms& parms, const QString& section, const QString& key)
+  {
+    QString name;
+    if(not parms(section, key, name))
+      return false;
+    if(name == "None")
+      type = NONE;
+    else if(name == "BlockJacobi")
+      type = BLOCK_JACOBI;
+    else if(name == "ILU0")
+      type = ILU0;
+    else {
+      out << "Error, unknown preconditioner '" << name << "' for " << key << endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Compute the preconditioner of A, must be called each time A changes
+  void setup(const BlockMatrix& A)
+  {
+    switch(type) {
+      case BLOCK_JACOBI:
+        setupBlockJacobi(A);
+        break;
+      case ILU0:
+        setupILU(A);
+        break;
+      case NONE:
+        break;
+    }
+  }
+
+  // Compute the preconditioner from the diagonal blocks of A only, for
+  // matrices which are not assembled. ILU0 is not available.
+  void setupDiagonal(const std::vector<Block5>& D)
+  {
+    if(type != BLOCK_JACOBI)
+      return;
+    const long N = D.size();
+    inv_diag.resize(N);
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      invertDiagonal(D[i], inv_diag[i]);
+  }
+
+  // z = M^-1 r, z and r may not be the same
+  void apply(const State& r, State& z) const
+  {
+    const long N = r.size();
+    switch(type) {
+      case NONE:
+        z = r;
+        break;
+      case BLOCK_JACOBI:
+#pragma omp parallel for schedule(static)
+        for(long i = 0 ; i < N ; ++i)
+          z[i] = inv_diag[i] * r[i];
+        break;
+      case ILU0:
+        for(long i = 0 ; i < N ; ++i) {
+          Point5d s = r[i];
+          for(size_t k = LU.begin(i) ; k < LU.diagonals[i] ; ++k)
+            s -= LU.blocks[k] * z[LU.columns[k]];
+          z[i] = s;
+        }
+        for(long i = N-1 ; i >= 0 ; --i) {
+          Point5d s = z[i];
+          for(size_t k = LU.diagonals[i]+1 ; k < LU.end(i) ; ++k)
+            s -= LU.blocks[k] * z[LU.columns[k]];
+          z[i] = inv_diag[i] * s;
+        }
+        break;
+    }
+  }
+
+private:
+  // Inverse of a diagonal block, the identity if it is singular
+  static void invertDiagonal(const Block5& D, Block5& inv)
+  {
+    if(not D.invert(inv)) {
+      inv.zero();
+      for(size_t a = 0 ; a < 5 ; ++a)
+        inv.v[a][a] = 1;
+    }
+  }
+
+  void setupBlockJacobi(const BlockMatrix& A)
+  {
+    const long N = A.nbRows();
+    inv_diag.resize(N);
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      invertDiagonal(A.diagonal(i), inv_diag[i]);
+  }
+
+  // Block ILU(0), L is stored below the diagonal (unit diagonal) and U on
+  // and above it, with the inverses of the diagonal blocks of U in inv_diag
+  void setupILU(const BlockMatrix& A)
+  {
+    const size_t N = A.nbRows();
+    LU = A;
+    inv_diag.resize(N);
+    for(size_t i = 0 ; i < N ; ++i) {
+      for(size_t p = LU.begin(i) ; p < LU.diagonals[i] ; ++p) {
+        const size_t k = LU.columns[p];
+        LU.blocks[p] = LU.blocks[p] * inv_diag[k];
+        for(size_t q = p+1 ; q < LU.end(i) ; ++q) {
+          size_t kj = LU.find(k, LU.columns[q]);
+          if(kj < LU.end(k))
+            LU.blocks[q] -= LU.blocks[p] * LU.blocks[kj];
+        }
+      }
+      invertDiagonal(LU.diagonal(i), inv_diag[i]);
+    }
+  }
+
+  std::vector<Block5> inv_diag;
+  BlockMatrix LU;
+};
+
+// Preconditioned conjugate gradient, x holds the initial guess and the
+// solution. Like the RDSolver, it may be used on the non-symmetric systems
+// of the Crank-Nicholson method, where it is not guaranteed to converge.
+template <typename Operator>
+Result conjugateGradient(const Operator& A, const Preconditioner& M, const State& b, State& x, const Parms& parms,
+                         Workspace& ws)
+{
+  const size_t N = b.size();
+  Result result;
+  State* v = ws.get(4, N);
+  State& r = v[0];
+  State& z = v[1];
+  State& p = v[2];
+  State& Ap = v[3];
+  A(x, Ap);
+  native::axpy(r, b, -1, Ap);
+  if(native::errorNorm(r, parms.tol_type, parms.unknowns) < parms.tol) {
+    result.converged = true;
+    return result;
+  }
+  M.apply(r, z);
+  p = z;
+  double rz = native::dot(r, z);
+  const size_t max_steps = parms.maxSteps(N);
+  while(result.iterations < max_steps) {
+    result.iterations++;
+    A(p, Ap);
+    double pAp = native::dot(p, Ap);
+    if(pAp == 0)
+      break;
+    double alpha = rz / pAp;
+    native::axpy(x, x, alpha, p);
+    native::axpy(r, r, -alpha, Ap);
+    if(native::errorNorm(r, parms.tol_type, parms.unknowns) < parms.tol) {
+      result.converged = true;
+      break;
+    }
+    M.apply(r, z);
+    double rz_new = native::dot(r, z);
+    native::axpy(p, z, rz_new / rz, p);
+    rz = rz_new;
+  }
+  return result;
+}
+
+// Right-preconditioned BiCGStab
+template <typename Operator>
+Result biCGStab(const Operator& A, const Preconditioner& M, const State& b, State& x, const Parms& parms,
+                Workspace& ws)
+{
+  const size_t N = b.size();
+  Result result;
+  State* w = ws.get(8, N);
+  State& r = w[0];
+  State& r0 = w[1];
+  State& p = w[2];
+  State& v = w[3];
+  State& ph = w[4];
+  State& s = w[5];
+  State& sh = w[6];
+  State& t = w[7];
+  std::fill(p.begin(), p.end(), Point5d(0, 0, 0, 0, 0));
+  std::fill(v.begin(), v.end(), Point5d(0, 0, 0, 0, 0));
+  A(x, t);
+  native::axpy(r, b, -1, t);
+  if(native::errorNorm(r, parms.tol_type, parms.unknowns) < parms.tol) {
+    result.converged = true;
+    return result;
+  }
+  r0 = r;
+  double rho = 1, alpha = 1, omega = 1;
+  const size_t max_steps = parms.maxSteps(N);
+  while(result.iterations < max_steps) {
+    result.iterations++;
+    double rho_new = native::dot(r0, r);
+    if(rho_new == 0)
+      break;
+    double beta = (rho_new / rho) * (alpha / omega);
+    rho = rho_new;
+    // p = r + beta (p - omega v)
+    const double a[2] = { beta, -beta * omega };
+    const State* vs[2] = { &p, &v };
+    native::combine(p, r, 2, a, vs);
+    M.apply(p, ph);
+    A(ph, v);
+    double r0v = native::dot(r0, v);
+    if(r0v == 0)
+      break;
+    alpha = rho / r0v;
+    native::axpy(s, r, -alpha, v);
+    if(native::errorNorm(s, parms.tol_type, parms.unknowns) < parms.tol) {
+      native::axpy(x, x, alpha, ph);
+      result.converged = true;
+      break;
+    }
+    M.apply(s, sh);
+    A(sh, t);
+    double tt = native::dot(t, t);
+    omega = tt > 0 ? native::dot(t, s) / tt : 0;
+    const double c[2] = { alpha, omega };
+    const State* us[2] = { &ph, &sh };
+    native::combine(x, x, 2, c, us);
+    native::axpy(r, s, -omega, t);
+    if(native::errorNorm(r, parms.tol_type, parms.unknowns) < parms.tol) {
+      result.converged = true;
+      break;
+    }
+    if(omega == 0)
+      break;
+  }
+  return result;
+}
+
+// Restarted, right-preconditioned GMRES with modified Gram-Schmidt
+template <typename Operator>
+Result gmres(const Operator& A, const Preconditioner& M, const State& b, State& x, const Parms& parms,
+             Workspace& ws)
+{
+  const size_t N = b.size();
+  const size_t m = std::max(parms.restart, 1);
+  const double tol2 = parms.twoNormTol(N);
+  Result result;
+  // Krylov basis in the m+1 first work vectors
+  State* V = ws.get(m+4, N);
+  State& r = V[m+1];
+  State& z = V[m+2];
+  State& w = V[m+3];
+  std::vector<std::vector<double> > H(m+1, std::vector<double>(m, 0.));
+  std::vector<double> cs(m), sn(m), g(m+1), y(m);
+  const size_t max_steps = parms.maxSteps(N);
+  while(true) {
+    A(x, w);
+    native::axpy(r, b, -1, w);
+    if(native::errorNorm(r, parms.tol_type, parms.unknowns) < parms.tol) {
+      result.converged = true;
+      break;
+    }
+    if(result.iterations >= max_steps)
+      break;
+    double beta = std::sqrt(native::dot(r, r));
+    native::scale(V[0], 1 / beta, r);
+    std::fill(g.begin(), g.end(), 0.);
+    g[0] = beta;
+    size_t j = 0;
+    while(j < m and result.iterations < max_steps) {
+      result.iterations++;
+      M.apply(V[j], z);
+      A(z, w);
+      for(size_t i = 0 ; i <= j ; ++i) {
+        H[i][j] = native::dot(w, V[i]);
+        native::axpy(w, w, -H[i][j], V[i]);
+      }
+      H[j+1][j] = std::sqrt(native::dot(w, w));
+      if(H[j+1][j] > 0)
+        native::scale(V[j+1], 1 / H[j+1][j], w);
+      for(size_t i = 0 ; i < j ; ++i) {
+        double h = cs[i] * H[i][j] + sn[i] * H[i+1][j];
+        H[i+1][j] = -sn[i] * H[i][j] + cs[i] * H[i+1][j];
+        H[i][j] = h;
+      }
+      double d = std::sqrt(H[j][j] * H[j][j] + H[j+1][j] * H[j+1][j]);
+      cs[j] = d > 0 ? H[j][j] / d : 1;
+      sn[j] = d > 0 ? H[j+1][j] / d : 0;
+      H[j][j] = d;
+      H[j+1][j] = 0;
+      g[j+1] = -sn[j] * g[j];
+      g[j] = cs[j] * g[j];
+      ++j;
+      if(std::abs(g[j]) < tol2 or d == 0)
+        break;
+    }
+    // x += M^-1 V y, with H y = g
+    for(size_t i = j ; i-- > 0 ;) {
+      double s = g[i];
+      for(size_t k = i+1 ; k < j ; ++k)
+        s -= H[i][k] * y[k];
+      y[i] = H[i][i] != 0 ? s / H[i][i] : 0;
+    }
+    std::vector<const State*> vs(j);
+    for(size_t i = 0 ; i < j ; ++i)
+      vs[i] = &V[i];
+    native::combine(w, j, &y[0], &vs[0]);
+    M.apply(w, z);
+    native::axpy(x, x, 1, z);
+  }
+  return result;
+}
+
+// Solve A x = b with the method of parms, x holds the initial guess
+template <typename Operator>
+Result solve(const Operator& A, const Preconditioner& M, const State& b, State& x, const Parms& parms,
+             Workspace& ws)
+{
+  switch(parms.method) {
+    case BICGSTAB:
+      return biCGStab(A, M, b, x, parms, ws);
+    case GMRES:
+      return gmres(A, M, b, x, parms, ws);
+    case CONJUGATE_GRADIENT:
+      break;
+  }
+  return conjugateGradient(A, M, b, x, parms, ws);
+}
+} // namespace krylov
+
+#endif // KRYLOV_H
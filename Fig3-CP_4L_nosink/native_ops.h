@@ -0,0 +1,343 @@
+#ifndef NATIVE_OPS_H
+#define NATIVE_OPS_H
+
+#include <util/parms.h>
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "compiled_graph.h"
+
+using cellflips::out;
+
+// Helpers for the parallel vector operations of the native solvers.
+//
+// Every loop only writes to the entries of its own node, and sums are
+// computed over a fixed partition of the nodes (independent of the number
+// of threads) before being added in order. The results are therefore
+// bitwise identical whatever the number of OpenMP threads.
+//
+// The vector operations are written for the concentrations of the solvers
+// (SolverState) as well as for the double vectors of the linear algebra
+// (State), and always compute in double.
+namespace native
+{
+typedef std::vector<Point5d> State;
+typedef std::vector<SolverPoint5> SolverState;
+
+const size_t REDUCTION_BLOCK = 1024;
+
+enum TolType
+{
+  MAX_COMPONENT,
+  MEAN_COMPONENT,
+  WEIGHTED_RMS      // root mean square, scaled by the Tolerances of each chemical
+};
+
+// Absolute and relative tolerances of each chemical, for the WeightedRMS
+// norm: the error of a component is divided by atol + rtol |c|, so the
+// norm is 1 at the tolerance whatever the magnitude of the chemical.
+struct Tolerances
+{
+  double atol[5] = { 1e-3, 1e-3, 1e-3, 1e-3, 1e-3 };
+  double rtol[5] = { 1e-3, 1e-3, 1e-3, 1e-3, 1e-3 };
+
+  double scale(size_t k, double c) const { return atol[k] + rtol[k] * std::abs(c); }
+};
+
+// Parameters of the adaptive explicit solvers, same meaning as for the
+// RDSolver
+struct AdaptiveParms
+{
+  double inc_dt = .1;
+  double res_dt = .5;
+  double min_dt = .001;
+  double max_dt = 1;
+  TolType tol_type = MAX_COMPONENT;
+  double res_tol = 1;
+  double low_tol = .01;
+  double high_tol = .05;
+
+  // Next step size from the error of an accepted step
+  double adapt(double h, double err) const
+  {
+    if(err > high_tol)
+      h *= 1 - inc_dt;
+    else if(err < low_tol)
+      h *= 1 + inc_dt;
+    return std::min(std::max(h, min_dt), max_dt);
+  }
+};
+
+// y = x + a*v
+template <typename P>
+void axpy(std::vector<P>& y, const std::vector<P>& x, double a, const std::vector<P>& v)
+{
+  const long N = x.size();
+#pragma omp parallel for schedule(static)
+  for(long i = 0 ; i < N ; ++i)
+    for(size_t c = 0 ; c < 5 ; ++c)
+      y[i][c] = x[i][c] + a*v[i][c];
+}
+
+// y = a*x
+template <typename P>
+void scale(std::vector<P>& y, double a, const std::vector<P>& x)
+{
+  const long N = x.size();
+#pragma omp parallel for schedule(static)
+  for(long i = 0 ; i < N ; ++i)
+    for(size_t c = 0 ; c < 5 ; ++c)
+      y[i][c] = a*x[i][c];
+}
+
+// y = x + sum_k a[k]*v[k], for the K first vectors in v
+template <typename P>
+void combine(std::vector<P>& y, const std::vector<P>& x, size_t K, const double* a,
+             const std::vector<P>* const* v)
+{
+  const long N = x.size();
+#pragma omp parallel for schedule(static)
+  for(long i = 0 ; i < N ; ++i) {
+    Point5d s;
+    for(size_t c = 0 ; c < 5 ; ++c)
+      s[c] = x[i][c];
+    for(size_t k = 0 ; k < K ; ++k)
+      if(a[k] != 0)
+        for(size_t c = 0 ; c < 5 ; ++c)
+          s[c] += a[k] * (*v[k])[i][c];
+    for(size_t c = 0 ; c < 5 ; ++c)
+      y[i][c] = s[c];
+  }
+}
+
+// y = sum_k a[k]*v[k], for the K first vectors in v
+template <typename P>
+void combine(std::vector<P>& y, size_t K, const double* a, const std::vector<P>* const* v)
+{
+  const long N = y.size();
+#pragma omp parallel for schedule(static)
+  for(long i = 0 ; i < N ; ++i) {
+    Point5d s = Point5d(0, 0, 0, 0, 0);
+    for(size_t k = 0 ; k < K ; ++k)
+      if(a[k] != 0)
+        for(size_t c = 0 ; c < 5 ; ++c)
+          s[c] += a[k] * (*v[k])[i][c];
+    for(size_t c = 0 ; c < 5 ; ++c)
+      y[i][c] = s[c];
+  }
+}
+
+// Copy x into y, converting the precision if needed
+template <typename P, typename Q>
+void copy(std::vector<P>& y, const std::vector<Q>& x)
+{
+  const long N = x.size();
+  y.resize(N);
+#pragma omp parallel for schedule(static)
+  for(long i = 0 ; i < N ; ++i)
+    for(size_t c = 0 ; c < 5 ; ++c)
+      y[i][c] = x[i][c];
+}
+
+// Maximum over the nodes of f(i)
+template <typename F>
+double maxReduce(size_t N, const F& f)
+{
+  double result = 0;
+#pragma omp parallel for schedule(static) reduction(max:result)
+  for(long i = 0 ; i < (long)N ; ++i) {
+    double v = f(i);
+    if(v > result)
+      result = v;
+  }
+  return result;
+}
+
+// Sum over the nodes of f(i), with a summation order independent of the
+// number of threads
+template <typename F>
+double sumReduce(size_t N, const F& f)
+{
+  const long nb_blocks = (N + REDUCTION_BLOCK - 1) / REDUCTION_BLOCK;
+  std::vector<double> partial(nb_blocks, 0.);
+#pragma omp parallel for schedule(static)
+  for(long b = 0 ; b < nb_blocks ; ++b) {
+    size_t end = std::min(N, (b+1)*REDUCTION_BLOCK);
+    double s = 0;
+    for(size_t i = b*REDUCTION_BLOCK ; i < end ; ++i)
+      s += f(i);
+    partial[b] = s;
+  }
+  double result = 0;
+  for(long b = 0 ; b < nb_blocks ; ++b)
+    result += partial[b];
+  return result;
+}
+
+// Scalar product of two states
+inline double dot(const State& x, const State& y)
+{
+  return sumReduce(x.size(), [&x, &y](size_t i) {
+                     double s = 0;
+                     for(size_t k = 0 ; k < 5 ; ++k)
+                       s += x[i][k] * y[i][k];
+                     return s;
+                   });
+}
+
+// Norm of an error vector, following the TolType of the RDSolver. Without
+// the states, WeightedRMS is the plain root mean square and Mean the mean
+// absolute value over the unknowns modelled components of e (see
+// CompiledGraph::nbUnknowns), 5 per node if unknowns is 0.
+template <typename P>
+double errorNorm(const std::vector<P>& e, TolType type, size_t unknowns = 0)
+{
+  if(type == MAX_COMPONENT)
+    return maxReduce(e.size(), [&e](size_t i) {
+                       double m = 0;
+                       for(size_t k = 0 ; k < 5 ; ++k)
+                         m = std::max(m, std::abs(double(e[i][k])));
+                       return m;
+                     });
+  if(e.empty())
+    return 0;
+  if(type == WEIGHTED_RMS) {
+    double s = sumReduce(e.size(), [&e](size_t i) {
+                           double m = 0;
+                           for(size_t k = 0 ; k < 5 ; ++k)
+                             m += double(e[i][k]) * double(e[i][k]);
+                           return m;
+                         });
+    return std::sqrt(s / (unknowns > 0 ? unknowns : 5*e.size()));
+  }
+  double s = sumReduce(e.size(), [&e](size_t i) {
+                         double m = 0;
+                         for(size_t k = 0 ; k < 5 ; ++k)
+                           m += std::abs(double(e[i][k]));
+                         return m;
+                       });
+  return s / (unknowns > 0 ? unknowns : 5*e.size());
+}
+
+// Norm of an error vector restricted to the nodes of ids
+template <typename P>
+double errorNorm(const std::vector<P>& e, const std::vector<size_t>& ids, TolType type,
+                 size_t unknowns = 0)
+{
+  if(type == MAX_COMPONENT)
+    return maxReduce(ids.size(), [&e, &ids](size_t r) {
+                       double m = 0;
+                       for(size_t k = 0 ; k < 5 ; ++k)
+                         m = std::max(m, std::abs(double(e[ids[r]][k])));
+                       return m;
+                     });
+  if(ids.empty())
+    return 0;
+  if(type == WEIGHTED_RMS) {
+    double s = sumReduce(ids.size(), [&e, &ids](size_t r) {
+                           double m = 0;
+                           for(size_t k = 0 ; k < 5 ; ++k)
+                             m += double(e[ids[r]][k]) * double(e[ids[r]][k]);
+                           return m;
+                         });
+    return std::sqrt(s / (unknowns > 0 ? unknowns : 5*ids.size()));
+  }
+  double s = sumReduce(ids.size(), [&e, &ids](size_t r) {
+                         double m = 0;
+                         for(size_t k = 0 ; k < 5 ; ++k)
+                           m += std::abs(double(e[ids[r]][k]));
+                         return m;
+                       });
+  return s / (unknowns > 0 ? unknowns : 5*ids.size());
+}
+
+// Modelled components of the nodes of ids
+inline size_t nbUnknowns(const CompiledGraph& G, const std::vector<size_t>& ids)
+{
+  return size_t(sumReduce(ids.size(), [&G, &ids](size_t r) {
+                            return double(CompiledGraph::nbComponents(G.type[ids[r]]));
+                          }));
+}
+
+// Weighted RMS norm of the error e of a step from c to y on the nodes of G,
+// restricted to the nodes of ids if not null. Each component is scaled by
+// the tolerances at the largest of its values in c and y, and the mean is
+// taken over the modelled components only, as the others are always 0.
+template <typename P, typename Q, typename R>
+double weightedNorm(const std::vector<P>& e, const std::vector<Q>& c, const std::vector<R>& y,
+                    const Tolerances& tol, const CompiledGraph& G, const std::vector<size_t>* ids = 0)
+{
+  const size_t N = ids ? ids->size() : e.size();
+  if(N == 0)
+    return 0;
+  const double unknowns = ids ? nbUnknowns(G, *ids) : G.nbUnknowns();
+  double s = sumReduce(N, [&e, &c, &y, &tol, ids](size_t r) {
+                         size_t i = ids ? (*ids)[r] : r;
+                         double m = 0;
+                         for(size_t k = 0 ; k < 5 ; ++k) {
+                           double v = std::max(std::abs(double(c[i][k])), std::abs(double(y[i][k])));
+                           double x = double(e[i][k]) / tol.scale(k, v);
+                           m += x * x;
+                         }
+                         return m;
+                       });
+  return std::sqrt(s / unknowns);
+}
+
+// Norm of the error e of a step from c to y on the nodes of G, weighted by
+// tol for WeightedRMS
+template <typename P, typename Q, typename R>
+double errorNorm(const std::vector<P>& e, const std::vector<Q>& c, const std::vector<R>& y,
+                 TolType type, const Tolerances& tol, const CompiledGraph& G)
+{
+  if(type == WEIGHTED_RMS)
+    return weightedNorm(e, c, y, tol, G);
+  return errorNorm(e, type, G.nbUnknowns());
+}
+
+// Same, restricted to the nodes of ids
+template <typename P, typename Q, typename R>
+double errorNorm(const std::vector<P>& e, const std::vector<size_t>& ids, const std::vector<Q>& c,
+                 const std::vector<R>& y, TolType type, const Tolerances& tol, const CompiledGraph& G)
+{
+  if(type == WEIGHTED_RMS)
+    return weightedNorm(e, c, y, tol, G, &ids);
+  if(type == MEAN_COMPONENT)
+    return errorNorm(e, ids, type, nbUnknowns(G, ids));
+  return errorNorm(e, ids, type);
+}
+
+inline bool readTolType(util::Parms& parms, const QString& section, const QString& key, TolType& type)
+{
+  QString name;
+  if(not parms(section, key, name))
+    return false;
+  if(name == "MaxComponent")
+    type = MAX_COMPONENT;
+  else if(name == "MeanComponent")
+    type = MEAN_COMPONENT;
+  else if(name == "WeightedRMS")
+    type = WEIGHTED_RMS;
+  else {
+    out << "Error, unknown tolerance type '" << name << "' for " << key << endl;
+    return false;
+  }
+  return true;
+}
+
+// Read the AbsTol<chemical> and RelTol<chemical> keys
+inline void readTolerances(util::Parms& parms, const QString& section, Tolerances& tol)
+{
+  static const char* names[5] = { "Auxin", "PIN", "APIN", "AAUX", "VAF" };
+  for(size_t k = 0 ; k < 5 ; ++k) {
+    parms(section, QString("AbsTol") + names[k], tol.atol[k]);
+    parms(section, QString("RelTol") + names[k], tol.rtol[k]);
+  }
+}
+} // namespace native
+
+#endif // NATIVE_OPS_H
@@ -0,0 +1,1524 @@
+#ifndef NATIVE_SOLVER_H
+#define NATIVE_SOLVER_H
+
+#include <util/parms.h>
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "compiled_graph.h"
+#include "native_ops.h"
+#include "block_matrix.h"
+#include "krylov.h"
+#include "graph_coloring.h"
+#include "quiescence.h"
+
+using cellflips::out;
+
+// Integrators working directly on the arrays of the CompiledGraph.
+//
+// They are selected with the same `Solver' key as the RDSolver and read
+// their parameters in the same section, reusing the RDSolver names where
+// the meaning is the same. The model must provide
+//
+//   void computeDerivatives(const native::SolverState& c, native::SolverState& dc);
+//
+// which evaluates the time derivatives of all the nodes, and for the
+// implicit solvers
+//
+//   void computeJacobian(const std::vector<Point5d>& c, BlockMatrix& J);
+//
+// which fills J with the Jacobian of the derivatives at c (unless the
+// Jacobian is set to ColoredFD, see JacobianEvaluator), or with
+// `JacobianMode: MatrixFree'
+//
+//   void multiplyJacobian(const std::vector<Point5d>& c, const std::vector<Point5d>& x,
+//                         std::vector<Point5d>& Jx);
+//   void computeJacobianDiagonal(const std::vector<Point5d>& c, std::vector<Block5>& D);
+//
+// which give the product of the Jacobian at c with x and its diagonal
+// blocks (computeJacobianDiagonal is also used by the ETD solver), and for
+// the IMEX
+// solver
+//
+//   void computeTransport(BlockMatrix& D);
+//
+// which fills D with the linear transport part of the derivatives, and for
+// the multirate solver
+//
+//   void computeMembraneDerivatives(const native::SolverState& c, native::SolverState& dc);
+//
+// which only evaluates the derivatives of the membranes.
+//
+// The explicit Runge-Kutta solvers (Euler, RungeKutta, AdaptiveEuler and
+// AdaptiveRungeKutta) can freeze the quiescent nodes, see
+// QuiescenceTracker for the parameters and the evaluation of the active
+// nodes the model must then provide.
+//
+// The implicit solvers (Crank-Nicholson, IMEX, Rosenbrock and BDF) and the
+// automatic switching between explicit and implicit solvers work in double
+// only, and are not available when built with SOLVER_FLOAT_STATE.
+class NativeSolver
+{
+public:
+  enum Method
+  {
+    NONE,
+    EULER,
+    RUNGE_KUTTA,
+    ADAPTIVE_EULER,
+    ADAPTIVE_RUNGE_KUTTA,
+#ifndef SOLVER_FLOAT_STATE
+    CRANK_NICHOLSON,
+    IMEX,
+    ROSENBROCK,
+    BDF,
+    AUTO,
+#endif
+    MULTIRATE,
+    ETD
+  };
+
+  struct Stats
+  {
+    size_t steps = 0;         // accepted steps
+    size_t rejected = 0;      // rejected steps
+    size_t evaluations = 0;   // evaluations of the derivatives
+    size_t jacobians = 0;     // evaluations of the Jacobian
+    size_t newton_iterations = 0;
+    size_t linear_iterations = 0;
+    size_t order_steps[6] = { 0, 0, 0, 0, 0, 0 };  // accepted BDF steps by order
+    size_t error_rejected = 0;    // rejected on the local error (CN with the PI controller)
+    size_t stiffness_checks = 0;  // estimates of the spectral radius (Auto)
+    size_t switches = 0;          // changes between explicit and implicit (Auto)
+    size_t node_evaluations = 0;  // derivatives of a node, with quiescent freezing
+    size_t frozen_nodes = 0;      // of which skipped as frozen
+  };
+
+  NativeSolver()
+    : method(NONE)
+    , dt(0)
+    , fsal(false)
+  {}
+
+  // Select the integrator from its name, returns false if the name is not
+  // one of the native solvers
+  bool setMethod(const QString& name)
+  {
+    if(name == "ParallelEuler")
+      method = EULER;
+    else if(name == "ParallelRungeKutta")
+      method = RUNGE_KUTTA;
+    else if(name == "ParallelAdaptiveEuler")
+      method = ADAPTIVE_EULER;
+    else if(name == "ParallelAdaptiveRungeKutta")
+      method = ADAPTIVE_RUNGE_KUTTA;
+#ifndef SOLVER_FLOAT_STATE
+    else if(name == "ParallelCrankNicholson")
+      method = CRANK_NICHOLSON;
+    else if(name == "ParallelIMEX")
+      method = IMEX;
+    else if(name == "ParallelRosenbrock")
+      method = ROSENBROCK;
+    else if(name == "ParallelBDF")
+      method = BDF;
+    else if(name == "ParallelAuto")
+      method = AUTO;
+#endif
+    else if(name == "ParallelMultirate")
+      method = MULTIRATE;
+    else if(name == "ParallelETD")
+      method = ETD;
+    else {
+      method = NONE;
+      return false;
+    }
+    return true;
+  }
+
+  void readParms(util::Parms& parms, const QString& section)
+  {
+    parms(section, "EulerDt", euler_dt);
+    parms(section, "RungeKuttaDt", runge_kutta_dt);
+    parms(section, "InitialDt", initial_dt);
+    parms(section, "MaxDt", max_dt);
+
+    parms(section, "AEulerIncDt", aeuler.inc_dt);
+    parms(section, "AEulerResDt", aeuler.res_dt);
+    parms(section, "AEulerMinDt", aeuler.min_dt);
+    parms(section, "AEulerMaxDt", aeuler.max_dt);
+    native::readTolType(parms, section, "AEulerTolType", aeuler.tol_type);
+    parms(section, "AEulerResTol", aeuler.res_tol);
+    parms(section, "AEulerLowTol", aeuler.low_tol);
+    parms(section, "AEulerHighTol", aeuler.high_tol);
+
+    parms(section, "ARungeIncDt", arunge.inc_dt);
+    parms(section, "ARungeResDt", arunge.res_dt);
+    parms(section, "ARungeMinDt", arunge.min_dt);
+    parms(section, "ARungeMaxDt", arunge.max_dt);
+    native::readTolType(parms, section, "ARungeTolType", arunge.tol_type);
+    parms(section, "ARungeResTol", arunge.res_tol);
+    parms(section, "ARungeLowTol", arunge.low_tol);
+    parms(section, "ARungeHighTol", arunge.high_tol);
+
+    parms(section, "MultirateSubsteps", multirate_substeps);
+
+    parms(section, "IMEXIncDt", imex.inc_dt);
+    parms(section, "IMEXResDt", imex.res_dt);
+    parms(section, "IMEXMinDt", imex.min_dt);
+    parms(section, "IMEXMaxDt", imex.max_dt);
+    native::readTolType(parms, section, "IMEXTolType", imex.tol_type);
+    parms(section, "IMEXResTol", imex.res_tol);
+    parms(section, "IMEXLowTol", imex.low_tol);
+    parms(section, "IMEXHighTol", imex.high_tol);
+
+    parms(section, "RosenIncDt", rosen.inc_dt);
+    parms(section, "RosenResDt", rosen.res_dt);
+    parms(section, "RosenMinDt", rosen.min_dt);
+    parms(section, "RosenMaxDt", rosen.max_dt);
+    native::readTolType(parms, section, "RosenTolType", rosen.tol_type);
+    parms(section, "RosenResTol", rosen.res_tol);
+    parms(section, "RosenLowTol", rosen.low_tol);
+    parms(section, "RosenHighTol", rosen.high_tol);
+
+    parms(section, "ETDIncDt", etd.inc_dt);
+    parms(section, "ETDResDt", etd.res_dt);
+    parms(section, "ETDMinDt", etd.min_dt);
+    parms(section, "ETDMaxDt", etd.max_dt);
+    native::readTolType(parms, section, "ETDTolType", etd.tol_type);
+    parms(section, "ETDResTol", etd.res_tol);
+    parms(section, "ETDLowTol", etd.low_tol);
+    parms(section, "ETDHighTol", etd.high_tol);
+
+    parms(section, "BDFIncDt", bdf_parms.inc_dt);
+    parms(section, "BDFResDt", bdf_parms.res_dt);
+    parms(section, "BDFMinDt", bdf_parms.min_dt);
+    parms(section, "BDFMaxDt", bdf_parms.max_dt);
+    native::readTolType(parms, section, "BDFTolType", bdf_parms.tol_type);
+    parms(section, "BDFResTol", bdf_parms.res_tol);
+    parms(section, "BDFLowTol", bdf_parms.low_tol);
+    parms(section, "BDFHighTol", bdf_parms.high_tol);
+    parms(section, "BDFMaxOrder", bdf_max_order);
+    bdf_max_order = std::min(std::max(bdf_max_order, 1), int(BDF_MAX_ORDER));
+
+    parms(section, "CRIncDt", cn.inc_dt);
+    parms(section, "CRResDt", cn.res_dt);
+    parms(section, "CRAvgCPU", cn.avg_cpu);
+    parms(section, "CRMinCPU", cn.min_cpu);
+    QString controller;
+    if(parms(section, "CRController", controller)) {
+      if(controller == "Efficiency")
+        cn.controller = CNParms::EFFICIENCY;
+      else if(controller == "PI")
+        cn.controller = CNParms::PI;
+      else
+        out << "Error, unknown controller '" << controller << "', using Efficiency" << endl;
+    }
+    native::readTolType(parms, section, "CRTolType", cn.tol_type);
+    parms(section, "CRTol", cn.tol);
+    parms(section, "CRSafety", cn.safety);
+    parms(section, "CRMaxFactor", cn.max_factor);
+    parms(section, "CRMinFactor", cn.min_factor);
+
+    parms(section, "NewtTol", newton.tol);
+    native::readTolType(parms, section, "NewtTolType", newton.tol_type);
+    native::readTolerances(parms, section, tolerances);
+    parms(section, "NewtMaxSteps", newton.max_steps);
+
+    parms(section, "ConjGradTol", linear.tol);
+    native::readTolType(parms, section, "ConjGradTolType", linear.tol_type);
+    parms(section, "ConjGradMaxSteps", linear.max_steps);
+    krylov::readMethod(parms, section, "LinearSolver", linear.method);
+    preconditioner.read(parms, section, "Preconditioner");
+    parms(section, "GMRESRestart", linear.restart);
+    jacobian.readParms(parms, section);
+    quiescence.readParms(parms, section);
+    QString mode;
+    if(parms(section, "JacobianMode", mode)) {
+      if(mode == "Assembled")
+        matrix_free = false;
+      else if(mode == "MatrixFree")
+        matrix_free = true;
+      else
+        out << "Error, unknown Jacobian mode '" << mode << "', using Assembled" << endl;
+    }
+    if(matrix_free and preconditioner.type == krylov::Preconditioner::ILU0) {
+      out << "The ILU0 preconditioner needs the assembled Jacobian, using BlockJacobi" << endl;
+      preconditioner.type = krylov::Preconditioner::BLOCK_JACOBI;
+    }
+
+#ifndef SOLVER_FLOAT_STATE
+    QString implicit;
+    if(parms(section, "AutoImplicit", implicit)) {
+      if(implicit == "CrankNicholson")
+        auto_parms.implicit = CRANK_NICHOLSON;
+      else if(implicit == "Rosenbrock")
+        auto_parms.implicit = ROSENBROCK;
+      else if(implicit == "BDF")
+        auto_parms.implicit = BDF;
+      else
+        out << "Error, unknown implicit solver '" << implicit << "', using CrankNicholson" << endl;
+    }
+    parms(section, "AutoCheckSteps", auto_parms.check_steps);
+    parms(section, "AutoPowerIterations", auto_parms.power_iterations);
+    parms(section, "AutoStiffRatio", auto_parms.stiff_ratio);
+    parms(section, "AutoHysteresis", auto_parms.hysteresis);
+    if(method == AUTO and auto_parms.implicit == CRANK_NICHOLSON and cn.controller != CNParms::PI) {
+      out << "Warning, ParallelAuto needs the step size of CrankNicholson to follow the error, "
+          << "using CRController: PI" << endl;
+      cn.controller = CNParms::PI;
+    }
+#endif
+
+    parms(section, "PrintStats", print_stats);
+
+    // The VAF binding rates of the transport may have changed
+    transport_valid = false;
+    next_dt = std::min(initial_dt, max_dt);
+    reset();
+  }
+
+  // Must be called when the derivatives of the current state may have
+  // changed outside of the solver (e.g. the parameters of the model)
+  void reset()
+  {
+    fsal = false;
+    slow_nodes.clear();
+  }
+
+  // Check the derivatives of the frozen nodes with a full evaluation at the
+  // next step, without the rest of reset(). Called once per drawing step.
+  void refreshFrozen()
+  {
+    if(freezing() and quiescence.nbFrozen() > 0)
+      fsal = false;
+  }
+
+  // Limit the size of the next step of the adaptive solvers, e.g. to end
+  // exactly at a given time
+  void limitStep(double h)
+  {
+    next_dt = std::min(next_dt, h);
+  }
+
+  // Advance the state of G by one step, dt is set to the size of the step
+  template <typename Model>
+  void operator()(CompiledGraph& G, Model& model)
+  {
+    linear.unknowns = G.nbUnknowns();
+    if(not fsal) {
+      model.computeDerivatives(G.c, G.dc);
+      stats.evaluations++;
+      fsal = true;
+      if(freezing())
+        quiescence.refresh(G, k);
+    }
+    advance(method, G, model);
+    G.state_version++;
+    if(freezing() and quiescence.update(G, k)) {
+      model.computeDerivatives(G.c, G.dc, quiescence.thawed());
+      stats.node_evaluations += quiescence.thawed().size();
+    }
+    if(freezing() and quiescence.checkDue())
+      fsal = false;
+  }
+
+  void printStats()
+  {
+    out << "Native solver: " << stats.steps << " steps, "
+        << stats.rejected << " rejected, "
+        << stats.evaluations << " evaluations" << endl;
+    if(stats.jacobians > 0 or stats.linear_iterations > 0)
+      out << "  " << stats.jacobians << " Jacobians, "
+          << stats.newton_iterations << " Newton iterations, "
+          << stats.linear_iterations << " linear iterations" << endl;
+    if(stats.error_rejected > 0)
+      out << "  " << stats.error_rejected << " steps rejected on their local error" << endl;
+#ifndef SOLVER_FLOAT_STATE
+    if(method == AUTO)
+      out << "  " << stats.stiffness_checks << " stiffness checks, "
+          << stats.switches << " switches, currently "
+          << (auto_method == ADAPTIVE_RUNGE_KUTTA ? "explicit" : "implicit") << endl;
+    if(method == BDF) {
+      out << "  BDF steps by order:";
+      for(size_t q = 1 ; q <= BDF_MAX_ORDER ; ++q)
+        out << " " << q << ": " << stats.order_steps[q];
+      out << ", current order " << bdf_order << endl;
+    }
+#endif
+    if(freezing() and stats.node_evaluations > 0)
+      out << "  " << quiescence.nbFrozen() << " frozen nodes, "
+          << 100. * stats.frozen_nodes / stats.node_evaluations
+          << "% of the node evaluations skipped" << endl;
+  }
+
+  Method method;
+  double dt;                  // size of the last step taken
+  Stats stats;
+  int print_stats = 0;
+
+protected:
+  typedef native::AdaptiveParms AdaptiveParms;
+
+  // Step size control of the Crank-Nicholson solver, selected with the
+  // `CRController' key.
+  //
+  // Efficiency uses the same parameters as the RDSolver: the step size
+  // follows the direction which lowers the work (Newton and linear
+  // iterations) per unit of time.
+  //
+  // PI is the PI controller of Gustafsson on the local error, normalised by
+  // CRTol: after an accepted step of error e,
+  //
+  //   h' = h * safety * e^(-0.7/3) * e_prev^(0.4/3)
+  //
+  // limited to [min_factor, max_factor] times h, and never larger than h
+  // right after a rejection. A step is rejected if e > 1, and then reduced
+  // by safety * e^(-1/3).
+  struct CNParms
+  {
+    enum Controller
+    {
+      EFFICIENCY,
+      PI
+    };
+
+    Controller controller = EFFICIENCY;
+    double inc_dt = .2;       // relative change of the step size
+    double res_dt = .5;       // decrement if Newton fails
+    double avg_cpu = .5;      // weight of the current step in the average work
+    double min_cpu = 5;       // below this work, always increase the step
+    double min_dt = 1e-6;     // smallest step size tried before giving up
+    native::TolType tol_type = native::MAX_COMPONENT;  // norm of the local error
+    double tol = 1e-3;        // largest local error of an accepted step
+    double safety = .9;       // factor on the optimal step size
+    double max_factor = 2;    // largest increase of the step size
+    double min_factor = .2;   // largest decrease of the step size
+
+    double avg = -1;          // running average of the work per unit time
+    double direction = 1;
+    double last_err = 0;      // normalised error of the last accepted step, 0 if none
+    bool rejected = false;    // the last step was rejected on its error
+
+    double adapt(double h, double work)
+    {
+      double cpu = work / h;
+      if(work < min_cpu)
+        direction = 1;
+      else if(avg >= 0 and cpu > avg)
+        direction = -direction;
+      avg = avg < 0 ? cpu : avg_cpu * cpu + (1 - avg_cpu) * avg;
+      return h * (1 + direction * inc_dt);
+    }
+
+    // Next step size after an accepted step with the normalised error err
+    double accept(double h, double err)
+    {
+      double factor = max_factor;
+      if(err > 0) {
+        factor = safety * std::pow(err, -.7/3);
+        if(last_err > 0)
+          factor *= std::pow(last_err, .4/3);
+      }
+      factor = std::min(std::max(factor, min_factor), rejected ? 1. : max_factor);
+      last_err = std::max(err, 1e-4);
+      rejected = false;
+      return h * factor;
+    }
+
+    // Step size to retry after a step rejected with the normalised error err
+    double reject(double h, double err)
+    {
+      rejected = true;
+      return h * std::max(min_factor, safety * std::pow(err, -1./3));
+    }
+  };
+
+  struct NewtonParms
+  {
+    double tol = 1e-5;
+    native::TolType tol_type = native::MAX_COMPONENT;
+    int max_steps = 10;
+  };
+
+  // One step of the solver m
+  template <typename Model>
+  void advance(Method m, CompiledGraph& G, Model& model)
+  {
+    switch(m) {
+      case EULER:
+        euler(G, model);
+        break;
+      case RUNGE_KUTTA:
+        rungeKutta(G, model);
+        break;
+      case ADAPTIVE_EULER:
+        adaptiveEuler(G, model);
+        break;
+      case ADAPTIVE_RUNGE_KUTTA:
+        adaptiveRungeKutta(G, model);
+        break;
+#ifndef SOLVER_FLOAT_STATE
+      case CRANK_NICHOLSON:
+        crankNicholson(G, model);
+        break;
+      case IMEX:
+        imexEuler(G, model);
+        break;
+      case ROSENBROCK:
+        rosenbrock(G, model);
+        break;
+      case BDF:
+        bdf(G, model);
+        break;
+      case AUTO:
+        automatic(G, model);
+        break;
+#endif
+      case MULTIRATE:
+        multirate(G, model);
+        break;
+      case ETD:
+        exponential(G, model);
+        break;
+      case NONE:
+        break;
+    }
+  }
+
+  // New entries are set to 0 for the frozen nodes
+  void resize(size_t N, std::vector<native::SolverState>& vs)
+  {
+    for(native::SolverState& v: vs)
+      if(v.size() != N) {
+        v.resize(N);
+        quiescence.zeroFrozen(v);
+      }
+  }
+
+  // Quiescent nodes are frozen for the current method
+  bool freezing() const
+  {
+    return quiescence.enabled and (method == EULER or method == RUNGE_KUTTA
+                                   or method == ADAPTIVE_EULER or method == ADAPTIVE_RUNGE_KUTTA);
+  }
+
+  // Derivatives at c for the explicit Runge-Kutta solvers, only on the
+  // active nodes when quiescent nodes are frozen
+  template <typename Model>
+  void evaluate(const CompiledGraph& G, Model& model, const native::SolverState& c, native::SolverState& dc)
+  {
+    if(not freezing()) {
+      model.computeDerivatives(c, dc);
+      return;
+    }
+    if(quiescence.nbFrozen() > 0)
+      model.computeDerivatives(c, dc, quiescence.active());
+    else
+      model.computeDerivatives(c, dc);
+    stats.node_evaluations += G.nbNodes();
+    stats.frozen_nodes += quiescence.nbFrozen();
+  }
+
+  // Error err of a step of size h, with the error of holding the frozen
+  // nodes
+  double withFrozenError(double err, double h, native::TolType type) const
+  {
+    if(not freezing())
+      return err;
+    double f = quiescence.frozenError(h, type, tolerances);
+    return type == native::WEIGHTED_RMS ? std::sqrt(err*err + f*f) : err + f;
+  }
+
+  template <typename Model>
+  void euler(CompiledGraph& G, Model& model)
+  {
+    dt = euler_dt;
+    native::axpy(G.c, G.c, dt, G.dc);
+    evaluate(G, model, G.c, G.dc);
+    stats.evaluations++;
+    stats.steps++;
+  }
+
+  // Classical 4th order Runge-Kutta
+  template <typename Model>
+  void rungeKutta(CompiledGraph& G, Model& model)
+  {
+    size_t N = G.nbNodes();
+    k.resize(4);
+    resize(N, k);
+    y.resize(N);
+    dt = runge_kutta_dt;
+
+    native::axpy(y, G.c, dt/2, G.dc);
+    evaluate(G, model, y, k[1]);
+    native::axpy(y, G.c, dt/2, k[1]);
+    evaluate(G, model, y, k[2]);
+    native::axpy(y, G.c, dt, k[2]);
+    evaluate(G, model, y, k[3]);
+    const double a[4] = { dt/6, dt/3, dt/3, dt/6 };
+    const native::SolverState* v[4] = { &G.dc, &k[1], &k[2], &k[3] };
+    native::combine(G.c, G.c, 4, a, v);
+    evaluate(G, model, G.c, G.dc);
+    stats.evaluations += 4;
+    stats.steps++;
+  }
+
+  // Euler step, the error is estimated from the difference with Heun's
+  // method
+  template <typename Model>
+  void adaptiveEuler(CompiledGraph& G, Model& model)
+  {
+    size_t N = G.nbNodes();
+    y.resize(N);
+    k.resize(2);
+    resize(N, k);
+    while(true) {
+      double h = next_dt;
+      native::axpy(y, G.c, h, G.dc);
+      evaluate(G, model, y, k[0]);
+      stats.evaluations++;
+      native::axpy(k[1], k[0], -1, G.dc);
+      double err = withFrozenError(h/2 * native::errorNorm(k[1], G.c, y, aeuler.tol_type, tolerances, G),
+                                   h, aeuler.tol_type);
+      if(err > aeuler.res_tol and h > aeuler.min_dt) {
+        next_dt = std::max(h * aeuler.res_dt, aeuler.min_dt);
+        stats.rejected++;
+        continue;
+      }
+      dt = h;
+      std::swap(G.c, y);
+      std::swap(G.dc, k[0]);
+      next_dt = aeuler.adapt(h, err);
+      stats.steps++;
+      break;
+    }
+  }
+
+  // Dormand-Prince 5(4), the last stage is the derivative at the new state
+  template <typename Model>
+  void adaptiveRungeKutta(CompiledGraph& G, Model& model)
+  {
+    static const double A[7][6] = {
+      { 0, 0, 0, 0, 0, 0 },
+      { 1./5, 0, 0, 0, 0, 0 },
+      { 3./40, 9./40, 0, 0, 0, 0 },
+      { 44./45, -56./15, 32./9, 0, 0, 0 },
+      { 19372./6561, -25360./2187, 64448./6561, -212./729, 0, 0 },
+      { 9017./3168, -355./33, 46732./5247, 49./176, -5103./18656, 0 },
+      { 35./384, 0, 500./1113, 125./192, -2187./6784, 11./84 }
+    };
+    // Difference between the 5th and 4th order weights
+    static const double E[7] = {
+      71./57600, 0, -71./16695, 71./1920, -17253./339200, 22./525, -1./40
+    };
+
+    size_t N = G.nbNodes();
+    k.resize(7);
+    resize(N, k);
+    y.resize(N);
+    const native::SolverState* v[7] = { &G.dc, &k[1], &k[2], &k[3], &k[4], &k[5], &k[6] };
+    while(true) {
+      double h = next_dt;
+      double a[7];
+      for(size_t s = 1 ; s < 7 ; ++s) {
+        for(size_t j = 0 ; j < s ; ++j)
+          a[j] = h * A[s][j];
+        native::combine(y, G.c, s, a, v);
+        evaluate(G, model, y, k[s]);
+      }
+      stats.evaluations += 6;
+      for(size_t j = 0 ; j < 7 ; ++j)
+        a[j] = h * E[j];
+      native::combine(k[0], 7, a, v);
+      double err = withFrozenError(native::errorNorm(k[0], G.c, y, arunge.tol_type, tolerances, G),
+                                   h, arunge.tol_type);
+      if(err > arunge.res_tol and h > arunge.min_dt) {
+        next_dt = std::max(h * arunge.res_dt, arunge.min_dt);
+        stats.rejected++;
+        continue;
+      }
+      dt = h;
+      std::swap(G.c, y);
+      std::swap(G.dc, k[6]);
+      next_dt = arunge.adapt(h, err);
+      stats.steps++;
+      break;
+    }
+  }
+
+#ifndef SOLVER_FLOAT_STATE
+  // Crank-Nicholson, the implicit equation
+  //
+  //   y = c + h/2 (f(c) + f(y))
+  //
+  // is solved with Newton's method, using the Jacobian of the model. The
+  // linear systems are solved in place of J, which is replaced by
+  // I - h/2 J.
+  //
+  // With the PI controller, the local error is estimated with Milne's
+  // device from the variable step Adams-Bashforth 2 predictor p, using the
+  // derivatives at the previous step of size h_p:
+  //
+  //   p = c + h f(c) + h^2/(2 h_p) (f(c) - f_p),  e = r/(3(r+1)) (y - p)
+  //
+  // with r = h/h_p. The previous derivatives are kept across reset(), and
+  // dropped when the state of G was modified outside of the solver. The
+  // first step without them is checked with the difference with the
+  // explicit Euler step, e = y - c - h f(c), which overestimates its error.
+  template <typename Model>
+  void crankNicholson(CompiledGraph& G, Model& model)
+  {
+    size_t N = G.nbNodes();
+    y.resize(N);
+    k.resize(3);
+    resize(N, k);
+    native::State& fy = k[0];
+    native::State& b = k[1];
+    native::State& delta = k[2];
+    const long NN = N;
+    while(true) {
+      const double h = next_dt;
+      const native::State& c = G.c;
+      const native::State& fc = G.dc;
+      auto A = [this, &model](const native::State& x, native::State& Ax) {
+        applyIterationMatrix(model, x, Ax);
+      };
+      size_t work = 0;
+      bool converged = false;
+      native::axpy(y, c, h, fc);
+      for(int it = 0 ; it < newton.max_steps ; ++it) {
+        model.computeDerivatives(y, fy);
+        stats.evaluations++;
+        evaluateJacobian(G, model, y, fy);
+        setIterationMatrix(h/2, false);
+#pragma omp parallel for schedule(static)
+        for(long i = 0 ; i < NN ; ++i) {
+          b[i] = c[i] + h/2 * (fc[i] + fy[i]) - y[i];
+          delta[i] = Point5d(0, 0, 0, 0, 0);
+        }
+        krylov::Result res = krylov::solve(A, preconditioner, b, delta, linear, krylov_work);
+        native::axpy(y, y, 1, delta);
+        stats.newton_iterations++;
+        stats.linear_iterations += res.iterations;
+        work += res.iterations + 1;
+        if(native::errorNorm(delta, y, y, newton.tol_type, tolerances, G) < newton.tol) {
+          converged = true;
+          break;
+        }
+      }
+      if(not converged and h > cn.min_dt) {
+        next_dt = std::max(h * cn.res_dt, cn.min_dt);
+        cn.rejected = true;
+        stats.rejected++;
+        continue;
+      }
+      if(not converged)
+        out << "Warning, Newton did not converge with the minimum time step" << endl;
+      double err = -1;
+      if(cn.controller == CNParms::PI) {
+        if(cn_past_dt > 0 and cn_past_dc.size() == N and cn_past_version == G.state_version) {
+          const double r = h / cn_past_dt;
+          const double a = h*h / (2 * cn_past_dt);
+          const double w = r / (3 * (r + 1));
+#pragma omp parallel for schedule(static)
+          for(long i = 0 ; i < NN ; ++i)
+            b[i] = w * (y[i] - c[i] - h * fc[i] - a * (fc[i] - cn_past_dc[i]));
+        } else {
+#pragma omp parallel for schedule(static)
+          for(long i = 0 ; i < NN ; ++i)
+            b[i] = y[i] - c[i] - h * fc[i];
+        }
+        err = native::errorNorm(b, c, y, cn.tol_type, tolerances, G) / cn.tol;
+        if(not (err <= 1) and h > cn.min_dt) {
+          next_dt = std::max(cn.reject(h, err), cn.min_dt);
+          stats.rejected++;
+          stats.error_rejected++;
+          continue;
+        }
+      }
+      dt = h;
+      std::swap(G.c, y);
+      if(cn.controller == CNParms::PI) {
+        std::swap(cn_past_dc, G.dc);
+        cn_past_dt = h;
+        cn_past_version = stepVersion(G);
+      }
+      G.dc.resize(N);
+      model.computeDerivatives(G.c, G.dc);
+      stats.evaluations++;
+      if(cn.controller == CNParms::EFFICIENCY)
+        next_dt = cn.adapt(h, work);
+      else if(err >= 0)
+        next_dt = cn.accept(h, err);
+      next_dt = std::min(std::max(next_dt, cn.min_dt), max_dt);
+      stats.steps++;
+      break;
+    }
+  }
+
+  // IMEX Euler: the linear transport D (diffusion and VAF binding) is
+  // implicit and the rest of the derivatives R = f - D is explicit
+  //
+  //   (I - h D) y = c + h R(c)
+  //
+  // The matrix I - h D and its preconditioner are kept while the step size
+  // does not change. D is only recomputed when the transport coefficients
+  // of G or the parameters of the solver change. The error is estimated on
+  // the explicit part, from the difference with the trapezoidal rule as for
+  // the adaptive Euler.
+  template <typename Model>
+  void imexEuler(CompiledGraph& G, Model& model)
+  {
+    size_t N = G.nbNodes();
+    if(not transport_valid or D.nbRows() != N or transport_version != G.transport_version) {
+      D.setStructure(G);
+      model.computeTransport(D);
+      transport_valid = true;
+      transport_version = G.transport_version;
+      imex_dt = 0;
+    }
+    y.resize(N);
+    k.resize(4);
+    resize(N, k);
+    native::State& Rc = k[0];
+    native::State& b = k[1];
+    native::State& fy = k[2];
+    native::State& Ry = k[3];
+    auto A = [this](const native::State& x, native::State& Ax) {
+      J.multiply(x, Ax);
+    };
+    D.multiply(G.c, Rc);
+    native::axpy(Rc, G.dc, -1, Rc);
+    while(true) {
+      double h = next_dt;
+      if(h != imex_dt) {
+        J = D;
+        J.scaleAddIdentity(-h, 1);
+        preconditioner.setup(J);
+        imex_dt = h;
+      }
+      native::axpy(b, G.c, h, Rc);
+      native::axpy(y, G.c, h, G.dc);
+      krylov::Result res = krylov::solve(A, preconditioner, b, y, linear, krylov_work);
+      stats.linear_iterations += res.iterations;
+      model.computeDerivatives(y, fy);
+      stats.evaluations++;
+      D.multiply(y, Ry);
+      native::axpy(Ry, fy, -1, Ry);
+      native::axpy(b, Ry, -1, Rc);
+      double err = h/2 * native::errorNorm(b, G.c, y, imex.tol_type, tolerances, G);
+      if((err > imex.res_tol or not res.converged) and h > imex.min_dt) {
+        next_dt = std::max(h * imex.res_dt, imex.min_dt);
+        stats.rejected++;
+        continue;
+      }
+      dt = h;
+      std::swap(G.c, y);
+      std::swap(G.dc, fy);
+      next_dt = imex.adapt(h, err);
+      stats.steps++;
+      break;
+    }
+  }
+
+  // Rosenbrock method of order 2(3) of ode23s (Shampine and Reichelt). It is
+  // linearly implicit: each step solves three linear systems with
+  //
+  //   W = I - h d J,   d = 1/(2 + sqrt(2))
+  //
+  // where J is the Jacobian at the beginning of the step, and needs no
+  // Newton iterations. J is kept when a step is rejected, only W is
+  // rebuilt. The error is estimated from the embedded third order solution,
+  // and the step adapted with the Rosen parameters.
+  template <typename Model>
+  void rosenbrock(CompiledGraph& G, Model& model)
+  {
+    const double d = 1 / (2 + std::sqrt(2.));
+    const double e32 = 6 + std::sqrt(2.);
+    size_t N = G.nbNodes();
+    y.resize(N);
+    k.resize(6);
+    resize(N, k);
+    native::State& k1 = k[0];
+    native::State& k2 = k[1];
+    native::State& k3 = k[2];
+    native::State& f1 = k[3];
+    native::State& f2 = k[4];
+    native::State& b = k[5];
+    const native::State& c = G.c;
+    const native::State& f0 = G.dc;
+    const long NN = N;
+    auto A = [this, &model](const native::State& x, native::State& Ax) {
+      applyIterationMatrix(model, x, Ax);
+    };
+    evaluateJacobian(G, model, c, f0);
+    while(true) {
+      const double h = next_dt;
+      setIterationMatrix(h*d, true);
+      size_t iterations = 0;
+      bool converged = true;
+      auto solve = [&](const native::State& rhs, native::State& x) {
+        krylov::Result res = krylov::solve(A, preconditioner, rhs, x, linear, krylov_work);
+        iterations += res.iterations;
+        converged = converged and res.converged;
+      };
+
+      // W k1 = f(c)
+      k1 = f0;
+      solve(f0, k1);
+      native::axpy(y, c, h/2, k1);
+      model.computeDerivatives(y, f1);
+
+      // W (k2 - k1) = f1 - k1
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < NN ; ++i) {
+        b[i] = f1[i] - k1[i];
+        k2[i] = Point5d(0, 0, 0, 0, 0);
+      }
+      solve(b, k2);
+      native::axpy(k2, k2, 1, k1);
+      native::axpy(y, c, h, k2);
+      model.computeDerivatives(y, f2);
+
+      // W k3 = f2 - e32 (k2 - f1) - 2 (k1 - f(c))
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < NN ; ++i) {
+        b[i] = f2[i] - e32 * (k2[i] - f1[i]) - 2. * (k1[i] - f0[i]);
+        k3[i] = k2[i];
+      }
+      solve(b, k3);
+      stats.evaluations += 2;
+      stats.linear_iterations += iterations;
+
+      // difference between the second and third order solutions
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < NN ; ++i)
+        b[i] = h/6 * (k1[i] - 2. * k2[i] + k3[i]);
+      double err = native::errorNorm(b, G.c, y, rosen.tol_type, tolerances, G);
+      if((not (err <= rosen.res_tol) or not converged) and h > rosen.min_dt) {
+        next_dt = std::max(h * rosen.res_dt, rosen.min_dt);
+        stats.rejected++;
+        continue;
+      }
+      dt = h;
+      std::swap(G.c, y);
+      std::swap(G.dc, f2);
+      next_dt = rosen.adapt(h, err);
+      stats.steps++;
+      break;
+    }
+  }
+
+  // Variable order (1 to BDFMaxOrder) and variable step BDF. The step to
+  // t_{n+1} = t_n + h solves
+  //
+  //   sum_j a_j y_{n+1-j} = f(y_{n+1}),  j = 0..q
+  //
+  // where a_j are the derivatives at t_{n+1} of the Lagrange polynomials on
+  // the actual past times, written as y = psi + gamma f(y) with
+  // gamma = 1/a_0. It is solved by a simplified Newton method, starting from
+  // the extrapolation of the past states, with W = I - gamma J.
+  //
+  // J is reused over many steps: it is only evaluated again when Newton
+  // fails to converge with an older Jacobian, and W is rebuilt when gamma
+  // changes by more than max_gamma_change. The local error of order k is
+  // estimated as k! h^(k+1) times the divided difference of order k+1 of
+  // the states. After q+1 steps at order q, the order which allows the
+  // largest next step among q-1, q and q+1 is selected.
+  //
+  // The past states are kept across reset(), and dropped when the state of
+  // G was modified outside of the solver.
+  template <typename Model>
+  void bdf(CompiledGraph& G, Model& model)
+  {
+    size_t N = G.nbNodes();
+    const long NN = N;
+    if(not jacobianMatches(N)) {
+      bdf_jacobian_valid = false;
+      w_gamma = 0;
+    }
+    if(bdf_past.empty() or bdf_past[0].size() != N or bdf_version != G.state_version) {
+      bdf_past.resize(1);
+      bdf_past[0] = G.c;
+      bdf_times.assign(1, 0.);
+      bdf_order = 1;
+      bdf_order_steps = 0;
+    }
+    y.resize(N);
+    k.resize(5);
+    resize(N, k);
+    native::State& yp = k[0];
+    native::State& psi = k[1];
+    native::State& fy = k[2];
+    native::State& r = k[3];
+    native::State& delta = k[4];
+    auto A = [this, &model](const native::State& x, native::State& Ax) {
+      applyIterationMatrix(model, x, Ax);
+    };
+    bool fresh_jacobian = false;
+    while(true) {
+      const double h = next_dt;
+      const size_t q = bdf_order;
+      const double t = bdf_times[0] + h;
+      double w[BDF_MAX_ORDER+2];
+      const native::State* v[BDF_MAX_ORDER+2];
+      for(size_t j = 0 ; j < bdf_past.size() ; ++j)
+        v[j] = &bdf_past[j];
+
+      // Predictor, extrapolation of the q+1 last states, or Euler step
+      // until there are enough of them
+      if(bdf_past.size() > q) {
+        for(size_t j = 0 ; j <= q ; ++j) {
+          w[j] = 1;
+          for(size_t m = 0 ; m <= q ; ++m)
+            if(m != j)
+              w[j] *= (t - bdf_times[m]) / (bdf_times[j] - bdf_times[m]);
+        }
+        native::combine(yp, q+1, w, v);
+      }
+      else
+        native::axpy(yp, G.c, h, G.dc);
+
+      // Corrector, y = psi + gamma f(y)
+      double a0 = 0;
+      for(size_t m = 0 ; m < q ; ++m)
+        a0 += 1 / (t - bdf_times[m]);
+      const double gamma = 1 / a0;
+      for(size_t j = 0 ; j < q ; ++j) {
+        double a = 1 / (bdf_times[j] - t);
+        for(size_t m = 0 ; m < q ; ++m)
+          if(m != j)
+            a *= (t - bdf_times[m]) / (bdf_times[j] - bdf_times[m]);
+        w[j] = -gamma * a;
+      }
+      native::combine(psi, q, w, v);
+
+      if(not bdf_jacobian_valid) {
+        evaluateJacobian(G, model, G.c, G.dc);
+        bdf_jacobian_valid = true;
+        fresh_jacobian = true;
+        w_gamma = 0;
+      }
+      if(w_gamma == 0 or std::abs(gamma / w_gamma - 1) > max_gamma_change) {
+        setIterationMatrix(gamma, true);
+        w_gamma = gamma;
+      }
+
+      y = yp;
+      bool converged = false;
+      double previous = 0;
+      for(int it = 0 ; it < newton.max_steps ; ++it) {
+        model.computeDerivatives(y, fy);
+        stats.evaluations++;
+#pragma omp parallel for schedule(static)
+        for(long i = 0 ; i < NN ; ++i) {
+          r[i] = psi[i] + gamma * fy[i] - y[i];
+          delta[i] = Point5d(0, 0, 0, 0, 0);
+        }
+        krylov::Result res = krylov::solve(A, preconditioner, r, delta, linear, krylov_work);
+        native::axpy(y, y, 1, delta);
+        stats.newton_iterations++;
+        stats.linear_iterations += res.iterations;
+        double norm = native::errorNorm(delta, y, y, newton.tol_type, tolerances, G);
+        if(norm < newton.tol) {
+          converged = true;
+          break;
+        }
+        // the iteration with an old W converges too slowly or diverges
+        if(it > 0 and not (norm < .9 * previous))
+          break;
+        previous = norm;
+      }
+      if(not converged and not fresh_jacobian) {
+        bdf_jacobian_valid = false;
+        continue;
+      }
+      if(not converged and h > bdf_parms.min_dt) {
+        next_dt = std::max(h * bdf_parms.res_dt, bdf_parms.min_dt);
+        stats.rejected++;
+        continue;
+      }
+      if(not converged)
+        out << "Warning, Newton did not converge with the minimum time step" << endl;
+
+      double err;
+      if(bdf_past.size() > q)
+        err = bdfError(G, q, h, t, y, r);
+      else {
+        native::axpy(r, y, -1, yp);
+        err = native::errorNorm(r, bdf_past[0], y, bdf_parms.tol_type, tolerances, G) / 2;
+      }
+      if(not (err <= bdf_parms.res_tol) and h > bdf_parms.min_dt) {
+        next_dt = std::max(h * bdf_parms.res_dt, bdf_parms.min_dt);
+        stats.rejected++;
+        continue;
+      }
+
+      // Order selection, from the errors the neighbor orders would have made
+      bdf_order_steps++;
+      if(bdf_order_steps > q) {
+        size_t order = q;
+        double best = stepFactor(q, err);
+        if(q > 1) {
+          double f = stepFactor(q-1, bdfError(G, q-1, h, t, y, r));
+          if(f > best) {
+            order = q-1;
+            best = f;
+          }
+        }
+        if(q < size_t(bdf_max_order) and bdf_past.size() > q+1) {
+          double f = stepFactor(q+1, bdfError(G, q+1, h, t, y, r));
+          if(f > 1.2 * best)
+            order = q+1;
+        }
+        if(order != q) {
+          bdf_order = order;
+          bdf_order_steps = 0;
+        }
+      }
+
+      if(bdf_past.size() < BDF_MAX_ORDER+1) {
+        bdf_past.push_back(native::State());
+        bdf_times.push_back(0);
+      }
+      std::rotate(bdf_past.begin(), bdf_past.end() - 1, bdf_past.end());
+      std::rotate(bdf_times.begin(), bdf_times.end() - 1, bdf_times.end());
+      bdf_past[0] = y;
+      bdf_times[0] = t;
+      bdf_version = stepVersion(G);
+
+      dt = h;
+      std::swap(G.c, y);
+      model.computeDerivatives(G.c, G.dc);
+      stats.evaluations++;
+      next_dt = bdf_parms.adapt(h, err);
+      stats.order_steps[q]++;
+      stats.steps++;
+      break;
+    }
+  }
+
+  // Evaluate the Jacobian at c, where the derivatives are fc. In matrix-free
+  // mode, only c and the diagonal blocks are kept.
+  template <typename Model>
+  void evaluateJacobian(const CompiledGraph& G, Model& model, const native::State& c,
+                        const native::State& fc)
+  {
+    if(matrix_free) {
+      jacobian_state = c;
+      model.computeJacobianDiagonal(c, jacobian_diagonal);
+    }
+    else {
+      if(J.nbRows() != G.nbNodes())
+        J.setStructure(G);
+      stats.evaluations += jacobian(G, model, c, fc, J);
+    }
+    stats.jacobians++;
+  }
+
+  // The Jacobian has been evaluated for a graph of N nodes
+  bool jacobianMatches(size_t N) const
+  {
+    return matrix_free ? jacobian_state.size() == N : J.nbRows() == N;
+  }
+
+  // Set the iteration matrix to I - s J and compute its preconditioner. If
+  // not keep_jacobian, the assembled J is overwritten.
+  void setIterationMatrix(double s, bool keep_jacobian)
+  {
+    iteration_scale = s;
+    if(matrix_free) {
+      const long N = jacobian_diagonal.size();
+      iteration_diagonal.resize(N);
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < N ; ++i) {
+        Block5& D = iteration_diagonal[i];
+        for(size_t a = 0 ; a < 5 ; ++a)
+          for(size_t b = 0 ; b < 5 ; ++b)
+            D.v[a][b] = (a == b ? 1 : 0) - s * jacobian_diagonal[i].v[a][b];
+      }
+      preconditioner.setupDiagonal(iteration_diagonal);
+    }
+    else if(keep_jacobian) {
+      W = J;
+      W.scaleAddIdentity(-s, 1);
+      preconditioner.setup(W);
+      iteration_matrix = &W;
+    }
+    else {
+      J.scaleAddIdentity(-s, 1);
+      preconditioner.setup(J);
+      iteration_matrix = &J;
+    }
+  }
+
+  // Ax = (I - s J) x, with the iteration matrix of setIterationMatrix
+  template <typename Model>
+  void applyIterationMatrix(Model& model, const native::State& x, native::State& Ax) const
+  {
+    if(matrix_free) {
+      model.multiplyJacobian(jacobian_state, x, Ax);
+      const long N = x.size();
+      const double s = iteration_scale;
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < N ; ++i)
+        Ax[i] = x[i] - s * Ax[i];
+    }
+    else
+      iteration_matrix->multiply(x, Ax);
+  }
+
+  // Automatic switching between the explicit AdaptiveRungeKutta and the
+  // implicit AutoImplicit solver. Every AutoCheckSteps steps, the spectral
+  // radius rho of the Jacobian is estimated by power iteration, which gives
+  // the largest stable step of Dormand-Prince on the negative real axis
+  //
+  //   h_stab = 3.3 / rho
+  //
+  // The explicit solver switches to the implicit one when its steps reach
+  // AutoStiffRatio * h_stab, as they are then limited by stability rather
+  // than accuracy. The implicit solver switches back when its steps are
+  // below h_stab / AutoHysteresis, where the explicit solver is stable at
+  // the same accuracy. This needs an implicit step size following the
+  // error: Rosenbrock, BDF, or Crank-Nicholson, which always uses the PI
+  // controller here.
+  template <typename Model>
+  void automatic(CompiledGraph& G, Model& model)
+  {
+    if(auto_method != ADAPTIVE_RUNGE_KUTTA and auto_method != auto_parms.implicit)
+      auto_method = ADAPTIVE_RUNGE_KUTTA;
+    advance(auto_method, G, model);
+    if(++auto_steps < size_t(std::max(auto_parms.check_steps, 1)))
+      return;
+    auto_steps = 0;
+    const double rho = spectralRadius(G, model);
+    stats.stiffness_checks++;
+    if(not (rho > 0))
+      return;
+    const double h_stab = DP5_STABILITY / rho;
+    if(auto_method == ADAPTIVE_RUNGE_KUTTA) {
+      if(dt >= auto_parms.stiff_ratio * h_stab) {
+        auto_method = auto_parms.implicit;
+        next_dt = std::min(auto_parms.hysteresis * h_stab, max_dt);
+        // The last explicit step gives the history of the CN error
+        // estimate: k[6] holds the derivatives at its start
+        cn_past_dc = k[6];
+        cn_past_dt = dt;
+        cn_past_version = stepVersion(G);
+        stats.switches++;
+      }
+    } else if(dt * auto_parms.hysteresis <= h_stab) {
+      auto_method = ADAPTIVE_RUNGE_KUTTA;
+      next_dt = std::min(std::max(dt, arunge.min_dt), arunge.max_dt);
+      stats.switches++;
+    }
+  }
+
+  // Spectral radius of the Jacobian at G.c, by power iteration on the
+  // products of multiplyJacobian. The iteration restarts from the vector of
+  // the previous estimate, which changes slowly.
+  template <typename Model>
+  double spectralRadius(const CompiledGraph& G, Model& model)
+  {
+    const long N = G.nbNodes();
+    native::State& v = power_vector;
+    native::State& Jv = power_product;
+    if(long(v.size()) != N) {
+      v.resize(N);
+      // deterministic start with mixed signs, unlikely to miss a mode
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < N ; ++i)
+        for(size_t a = 0 ; a < 5 ; ++a)
+          v[i][a] = double((i * 5 + a) * 7919 % 13) - 6.5;
+    }
+    Jv.resize(N);
+    double rho = 0;
+    double norm = std::sqrt(native::dot(v, v));
+    for(int it = 0 ; it < auto_parms.power_iterations and norm > 0 ; ++it) {
+      native::scale(v, 1 / norm, v);
+      model.multiplyJacobian(G.c, v, Jv);
+      norm = std::sqrt(native::dot(Jv, Jv));
+      rho = norm;
+      std::swap(v, Jv);
+    }
+    return rho;
+  }
+
+  // Local error of the BDF of order k at the new state y at time t,
+  // k! h^(k+1) times the divided difference of order k+1 of y and the k+1
+  // last states. e is used as workspace.
+  double bdfError(const CompiledGraph& G, size_t k, double h, double t, const native::State& y,
+                  native::State& e) const
+  {
+    double scale = std::pow(h, double(k+1));
+    for(size_t m = 2 ; m <= k ; ++m)
+      scale *= m;
+    double w[BDF_MAX_ORDER+3];
+    const native::State* v[BDF_MAX_ORDER+3];
+    w[0] = scale;
+    v[0] = &y;
+    for(size_t m = 0 ; m <= k ; ++m)
+      w[0] /= t - bdf_times[m];
+    for(size_t j = 0 ; j <= k ; ++j) {
+      w[j+1] = scale / (bdf_times[j] - t);
+      for(size_t m = 0 ; m <= k ; ++m)
+        if(m != j)
+          w[j+1] /= bdf_times[j] - bdf_times[m];
+      v[j+1] = &bdf_past[j];
+    }
+    native::combine(e, k+2, w, v);
+    return native::errorNorm(e, bdf_past[0], y, bdf_parms.tol_type, tolerances, G);
+  }
+
+  // Relative size of the next step allowed at order k with the error err
+  double stepFactor(size_t k, double err) const
+  {
+    if(not (err > 0))
+      return err == 0 ? HUGE_VAL : 0;
+    return std::pow(bdf_parms.high_tol / err, 1. / (k+1));
+  }
+
+  // G.state_version once the current step is done, see operator()
+  static size_t stepVersion(const CompiledGraph& G)
+  {
+    return G.state_version + 1;
+  }
+
+#endif // SOLVER_FLOAT_STATE
+
+  // Multirate Euler: the membranes, whose APIN and AAUX kinetics are fast,
+  // take multirate_substeps Euler steps per macro step of the cells and
+  // apoplasts. During the sub-steps, the cells and apoplasts follow the
+  // linear extrapolation of their state at the beginning of the macro step,
+  // which gives their Euler step at the end of it.
+  //
+  // The error is estimated as for the adaptive Euler, separately on the
+  // slow nodes over the macro step and on the membranes over each sub-step,
+  // and the macro step is adapted with the AEuler parameters.
+  template <typename Model>
+  void multirate(CompiledGraph& G, Model& model)
+  {
+    size_t N = G.nbNodes();
+    if(slow_nodes.empty()) {
+      slow_nodes = G.cells;
+      slow_nodes.insert(slow_nodes.end(), G.apoplasts.begin(), G.apoplasts.end());
+    }
+    y.resize(N);
+    k.resize(3);
+    resize(N, k);
+    const size_t m = std::max(multirate_substeps, 1);
+    const long nb_slow = slow_nodes.size();
+    const long nb_membranes = G.membranes.size();
+    native::SolverState& e = k[2];
+    while(true) {
+      const double H = next_dt;
+      const double h = H / m;
+      y = G.c;
+      k[0] = G.dc;
+      double err_fast = 0;
+      for(size_t s = 1 ; s <= m ; ++s) {
+        const native::SolverState& fm = k[0];
+#pragma omp parallel
+        {
+#pragma omp for schedule(static) nowait
+          for(long r = 0 ; r < nb_membranes ; ++r) {
+            const size_t i = G.membranes[r];
+            for(size_t a = 0 ; a < 5 ; ++a)
+              y[i][a] += h * fm[i][a];
+          }
+#pragma omp for schedule(static) nowait
+          for(long r = 0 ; r < nb_slow ; ++r) {
+            const size_t i = slow_nodes[r];
+            for(size_t a = 0 ; a < 5 ; ++a)
+              y[i][a] = G.c[i][a] + (s*h) * G.dc[i][a];
+          }
+        }
+        if(s == m)
+          model.computeDerivatives(y, k[1]);
+        else
+          model.computeMembraneDerivatives(y, k[1]);
+        stats.evaluations++;
+#pragma omp parallel for schedule(static)
+        for(long r = 0 ; r < nb_membranes ; ++r) {
+          const size_t i = G.membranes[r];
+          e[i] = k[1][i] - k[0][i];
+        }
+        err_fast = std::max(err_fast, h/2 * native::errorNorm(e, G.membranes, G.c, y, aeuler.tol_type,
+                                                              tolerances, G));
+        std::swap(k[0], k[1]);
+      }
+      // k[0] holds the derivatives at the end of the macro step
+#pragma omp parallel for schedule(static)
+      for(long r = 0 ; r < nb_slow ; ++r) {
+        const size_t i = slow_nodes[r];
+        e[i] = k[0][i] - G.dc[i];
+      }
+      double err_slow = H/2 * native::errorNorm(e, slow_nodes, G.c, y, aeuler.tol_type, tolerances, G);
+      double err = std::max(err_slow, err_fast);
+      if(err > aeuler.res_tol and H > aeuler.min_dt) {
+        next_dt = std::max(H * aeuler.res_dt, aeuler.min_dt);
+        stats.rejected++;
+        continue;
+      }
+      dt = H;
+      std::swap(G.c, y);
+      std::swap(G.dc, k[0]);
+      next_dt = aeuler.adapt(H, err);
+      stats.steps++;
+      break;
+    }
+  }
+
+  // Exponential time differencing, ETD2RK of Cox and Matthews. The linear
+  // part L is the diagonal of the Jacobian at the beginning of the step,
+  // restricted to its negative entries: the decay and exchange terms of
+  // each chemical in its own node (turnover, PIN endocytosis, APIN breakup,
+  // VAF unbinding, ...). It is integrated exactly, and the rest
+  // N = f - L c explicitly:
+  //
+  //   a = c + h phi1(hL) f(c)
+  //   y = a + h phi2(hL) (N(a) - N(c))
+  //
+  // with phi1(z) = (e^z - 1)/z and phi2(z) = (e^z - 1 - z)/z^2. The second
+  // term estimates the error, and the step is adapted with the ETD
+  // parameters. No linear system is solved.
+  template <typename Model>
+  void exponential(CompiledGraph& G, Model& model)
+  {
+    size_t N = G.nbNodes();
+    const long NN = N;
+    y.resize(N);
+    k.resize(2);
+    resize(N, k);
+    native::SolverState& fa = k[0];
+    native::SolverState& e = k[1];
+    native::copy(jacobian_state, G.c);
+    model.computeJacobianDiagonal(jacobian_state, jacobian_diagonal);
+    decay.resize(N);
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < NN ; ++i)
+      for(size_t a = 0 ; a < 5 ; ++a)
+        decay[i][a] = std::min(jacobian_diagonal[i].v[a][a], 0.);
+    while(true) {
+      const double h = next_dt;
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < NN ; ++i)
+        for(size_t a = 0 ; a < 5 ; ++a)
+          y[i][a] = G.c[i][a] + h * phi1(h * decay[i][a]) * G.dc[i][a];
+      model.computeDerivatives(y, fa);
+#pragma omp parallel for schedule(static)
+      for(long i = 0 ; i < NN ; ++i)
+        for(size_t a = 0 ; a < 5 ; ++a) {
+          const double L = decay[i][a];
+          double dN = fa[i][a] - G.dc[i][a] - L * (y[i][a] - G.c[i][a]);
+          e[i][a] = h * phi2(h * L) * dN;
+          y[i][a] += e[i][a];
+        }
+      double err = native::errorNorm(e, G.c, y, etd.tol_type, tolerances, G);
+      if(not (err <= etd.res_tol) and h > etd.min_dt) {
+        next_dt = std::max(h * etd.res_dt, etd.min_dt);
+        stats.evaluations++;
+        stats.rejected++;
+        continue;
+      }
+      dt = h;
+      std::swap(G.c, y);
+      model.computeDerivatives(G.c, G.dc);
+      stats.evaluations += 2;
+      next_dt = etd.adapt(h, err);
+      stats.steps++;
+      break;
+    }
+  }
+
+  // phi1(z) = (e^z - 1)/z
+  static double phi1(double z)
+  {
+    if(std::abs(z) < 1e-8)
+      return 1 + z/2;
+    return std::expm1(z) / z;
+  }
+
+  // phi2(z) = (e^z - 1 - z)/z^2, from its series close to 0
+  static double phi2(double z)
+  {
+    if(std::abs(z) < 1e-2)
+      return 1./2 + z * (1./6 + z * (1./24 + z / 120));
+    return (std::expm1(z) - z) / (z * z);
+  }
+
+  double euler_dt = .01;
+  double runge_kutta_dt = .01;
+  double initial_dt = .01;
+  double max_dt = 1;
+  AdaptiveParms aeuler, arunge, imex, rosen, bdf_parms, etd;
+  int multirate_substeps = 10;
+  std::vector<size_t> slow_nodes;   // cells and apoplasts, for the multirate solver
+  CNParms cn;
+
+  // Parameters of the automatic switching
+  struct AutoParms
+  {
+#ifndef SOLVER_FLOAT_STATE
+    Method implicit = CRANK_NICHOLSON;
+#endif
+    int check_steps = 10;       // steps between two stiffness checks
+    int power_iterations = 10;  // products by J for each estimate
+    double stiff_ratio = .8;    // fraction of h_stab where the explicit solver is stiff
+    double hysteresis = 2;      // h_stab / h below which the implicit solver switches back
+  };
+  AutoParms auto_parms;
+  Method auto_method = NONE;  // solver of the current step of ParallelAuto
+  size_t auto_steps = 0;      // steps since the last stiffness check
+  native::State power_vector, power_product;
+  static constexpr double DP5_STABILITY = 3.3;  // stability limit of Dormand-Prince, h rho
+  NewtonParms newton;
+  krylov::Parms linear;
+  krylov::Preconditioner preconditioner;
+  krylov::Workspace krylov_work;
+  JacobianEvaluator jacobian;
+  QuiescenceTracker quiescence;
+  native::Tolerances tolerances;   // per chemical, for the WeightedRMS norms
+
+  double next_dt = .01;       // size of the next step for adaptive solvers
+  bool fsal;                  // G.dc holds the derivatives at G.c
+  bool transport_valid = false;  // D is the transport of the current model
+  size_t transport_version = 0;  // G.transport_version when D was computed
+  double imex_dt = 0;         // step size of the IMEX matrix in J
+  native::State cn_past_dc;   // derivatives at the start of the last CN step
+  double cn_past_dt = 0;      // size of the last CN step, 0 if unknown
+  size_t cn_past_version = 0; // G.state_version at the end of the last CN step
+
+  native::SolverState y;
+  std::vector<native::SolverState> k;
+  BlockMatrix J;
+  BlockMatrix D;
+  BlockMatrix W;              // I - h d J (Rosenbrock) or I - gamma J (BDF)
+
+  // Iteration matrix I - s J of the implicit solvers, see setIterationMatrix
+  bool matrix_free = false;   // J is never assembled, only its products
+  const BlockMatrix* iteration_matrix = 0;
+  double iteration_scale = 0;
+  native::State jacobian_state;             // state of J in matrix-free mode
+  std::vector<Block5> jacobian_diagonal;    // diagonal blocks of J
+  std::vector<Block5> iteration_diagonal;   // diagonal blocks of I - s J
+  native::State decay;        // linear part of the ETD solver, <= 0
+
+  // State of the BDF solver
+  static const size_t BDF_MAX_ORDER = 5;
+  int bdf_max_order = BDF_MAX_ORDER;
+  size_t bdf_order = 1;
+  size_t bdf_order_steps = 0;        // accepted steps at the current order
+  std::vector<native::State> bdf_past;  // last accepted states, most recent first
+  std::vector<double> bdf_times;     // their times, relative to the start
+  size_t bdf_version = 0;            // G.state_version at the end of the last BDF step
+  bool bdf_jacobian_valid = false;   // J was evaluated at one of the past states
+  double w_gamma = 0;                // gamma of W, 0 if W must be rebuilt
+  const double max_gamma_change = .3;  // relative change of gamma rebuilding W
+};
+
+#endif // NATIVE_SOLVER_H
@@ -0,0 +1,91 @@
+from __future__ import absolute_import, print_function, unicode_literals, division
+
+# Compare a run of the model with the concentrations stored in double and in
+# float (make FLOAT_STATE=1). Both builds are made in temporary copies of
+# this directory, and the results of their output.ini are compared.
+#
+# Both runs use the same native solver, set in the copies of view.v, as the
+# RDSolver and the implicit native solvers are not available in float.
+#
+# Usage: python precision_drift.py [--solver=ParallelAdaptiveEuler] [make options]
+
+import io
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+FALLBACK_MESSAGE = 'is not available with SOLVER_FLOAT_STATE'
+
+
+def set_solver(view, solver):
+    with io.open(view, encoding='utf-8') as f:
+        text = f.read()
+    text, n = re.subn(r'^Solver:[^\n]*', 'Solver: ' + solver, text, count=1, flags=re.MULTILINE)
+    if n != 1:
+        raise RuntimeError("No Solver key in " + view)
+    with io.open(view, 'w', encoding='utf-8') as f:
+        f.write(text)
+
+
+def build_and_run(src, flags, solver):
+    d = tempfile.mkdtemp(prefix='precision_')
+    try:
+        work = os.path.join(d, 'model')
+        shutil.copytree(src, work, ignore=shutil.ignore_patterns('*.o', '*.vve', 'output*'))
+        set_solver(os.path.join(work, 'view.v'), solver)
+        subprocess.check_call(['make', '-C', work] + flags)
+        log = os.path.join(work, 'run.log')
+        start = time.time()
+        with open(log, 'wb') as f:
+            subprocess.check_call(['vveinterpreter', '--batch', 'model'], cwd=work, stdout=f, stderr=f)
+        elapsed = time.time() - start
+        with io.open(log, encoding='utf-8', errors='replace') as f:
+            if FALLBACK_MESSAGE in f.read():
+                raise RuntimeError("Solver '{}' is not available in float, the runs would use "
+                                   "different integrators".format(solver))
+        results = read_results(os.path.join(work, 'output.ini'))
+    finally:
+        shutil.rmtree(d)
+    return results, elapsed
+
+
+def read_results(filename):
+    results = {}
+    with open(filename) as f:
+        for line in f:
+            if '=' not in line:
+                continue
+            key, value = line.split('=', 1)
+            results[key.strip()] = [float(v) for v in value.split()]
+    return results
+
+
+def drift(ref, other):
+    return max(abs(a - b) / max(abs(a), 1e-300) for a, b in zip(ref, other))
+
+
+if __name__ == '__main__':
+    src = os.path.dirname(os.path.abspath(__file__))
+    solver = 'ParallelAdaptiveEuler'
+    flags = []
+    for arg in sys.argv[1:]:
+        if arg.startswith('--solver='):
+            solver = arg[len('--solver='):]
+        else:
+            flags.append(arg)
+    try:
+        ref, t_double = build_and_run(src, flags, solver)
+        res, t_float = build_and_run(src, flags + ['FLOAT_STATE=1'], solver)
+    except RuntimeError as e:
+        sys.exit("Error, {}".format(e))
+    print("Solver: {}".format(solver))
+    print("Run time: double {:.2f}s, float {:.2f}s ({:.2f}x)".format(t_double, t_float, t_double / t_float))
+    for key in sorted(set(ref) | set(res)):
+        if key not in ref or key not in res:
+            print("{}: only in the {} run".format(key, 'double' if key in ref else 'float'))
+        else:
+            print("{}: {} / {}, relative drift {:.3g}".format(key, ref[key], res[key], drift(ref[key], res[key])))
@@ -0,0 +1,299 @@
+#ifndef QUIESCENCE_H
+#define QUIESCENCE_H
+
+#include <util/parms.h>
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+#include "compiled_graph.h"
+#include "native_ops.h"
+
+// Nodes whose derivatives are evaluated, as ranks in the cells, membranes
+// and apoplasts lists of the CompiledGraph
+struct ActiveNodes
+{
+  std::vector<size_t> cells, membranes, apoplasts;
+
+  size_t size() const { return cells.size() + membranes.size() + apoplasts.size(); }
+  bool empty() const { return size() == 0; }
+  void clear()
+  {
+    cells.clear();
+    membranes.clear();
+    apoplasts.clear();
+  }
+};
+
+// Freezing of the quiescent nodes for the explicit native solvers, enabled
+// with the `Quiescent' key.
+//
+// Once the patterns are formed, most nodes barely change. A node whose
+// derivatives stay below QuiescentTol (largest component) during
+// QuiescentWindow accepted steps is frozen: its concentrations are held,
+// its derivatives are set to 0 and no longer evaluated. The model must
+// provide
+//
+//   void computeDerivatives(const native::SolverState& c, native::SolverState& dc,
+//                           const ActiveNodes& active);
+//
+// which only evaluates the derivatives of the active nodes, reading the
+// transcendental terms of the frozen ones from the last full evaluation.
+//
+// A frozen node is thawed when one of its active neighbors has drifted by
+// more than QuiescentBound (largest component) from its reference state,
+// which is the state of the neighbor when it was last frozen, thawed or
+// found drifted. The derivatives of the frozen nodes are also checked with
+// a full evaluation every QuiescentCheck accepted steps (and at least once
+// per drawing step, see NativeSolver::refreshFrozen), which thaws the ones
+// above QuiescentTol again. Holding a frozen node over a step of size h is
+// counted as an error of h * QuiescentTol on each of its modelled
+// components in the error control, so a frozen node whose derivatives grew
+// above QuiescentTol is held at most QuiescentCheck steps.
+//
+// All the loops only write the entries of their own node, so the frozen
+// set does not depend on the number of threads.
+class QuiescenceTracker
+{
+public:
+  void readParms(util::Parms& parms, const QString& section)
+  {
+    parms(section, "Quiescent", enabled);
+    parms(section, "QuiescentTol", tol);
+    parms(section, "QuiescentWindow", window);
+    parms(section, "QuiescentBound", bound);
+    parms(section, "QuiescentCheck", check);
+  }
+
+  // Make all the nodes of G active
+  void clear(const CompiledGraph& G)
+  {
+    const size_t N = G.nbNodes();
+    state.assign(N, ACTIVE);
+    quiet.assign(N, 0);
+    event.assign(N, 0);
+    ref = G.c;
+    nb_frozen = 0;
+    steps = 0;
+    unknowns = G.nbUnknowns();
+    updateLists(G);
+  }
+
+  // After a full evaluation of G.dc at G.c: thaw the frozen nodes whose
+  // derivatives are above tol, and set the derivatives of the others to 0
+  // in G.dc and in the work vectors
+  void refresh(CompiledGraph& G, std::vector<native::SolverState>& work)
+  {
+    if(state.size() != G.nbNodes()) {
+      clear(G);
+      return;
+    }
+    steps = 0;
+    if(nb_frozen == 0)
+      return;
+    const long N = G.nbNodes();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i) {
+      event[i] = 0;
+      if(state[i] != FROZEN)
+        continue;
+      if(rate(G.dc[i]) >= tol) {
+        state[i] = ACTIVE;
+        quiet[i] = 0;
+        ref[i] = G.c[i];
+        event[i] = 1;
+      } else
+        zero(i, G, work);
+    }
+    if(native::maxReduce(N, [this](size_t i) { return double(event[i]); }) > 0)
+      updateLists(G);
+  }
+
+  // After an accepted step, where G.dc holds the derivatives at G.c of the
+  // active nodes. Freezes and thaws nodes, the entries of the new frozen
+  // nodes are set to 0 in G.dc and in the work vectors. Returns true if
+  // nodes were thawed: their derivatives must then be evaluated, on the
+  // thawed() nodes.
+  bool update(CompiledGraph& G, std::vector<native::SolverState>& work)
+  {
+    if(state.size() != G.nbNodes()) {
+      clear(G);
+      return false;
+    }
+    steps++;
+    const long N = G.nbNodes();
+    // Active nodes which moved away from their reference state
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i) {
+      event[i] = 0;
+      if(state[i] != FROZEN) {
+        double m = 0;
+        for(size_t a = 0 ; a < 5 ; ++a)
+          m = std::max(m, std::abs(double(G.c[i][a]) - double(ref[i][a])));
+        if(m > bound)
+          event[i] = DRIFTED;
+      }
+    }
+    // Thaw the frozen nodes next to them
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i) {
+      if(state[i] != FROZEN)
+        continue;
+      for(size_t k = G.begin(i) ; k < G.end(i) ; ++k)
+        if(event[G.neighbors[k]] == DRIFTED) {
+          state[i] = THAWED;
+          break;
+        }
+    }
+    // Freeze the active nodes quiet for long enough
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i) {
+      if(state[i] == FROZEN)
+        continue;
+      if(state[i] == THAWED) {
+        quiet[i] = 0;
+        ref[i] = G.c[i];
+        event[i] = THAWED;
+        continue;
+      }
+      if(event[i] == DRIFTED)
+        ref[i] = G.c[i];
+      if(rate(G.dc[i]) >= tol)
+        quiet[i] = 0;
+      else if(++quiet[i] >= window) {
+        state[i] = FROZEN;
+        ref[i] = G.c[i];
+        zero(i, G, work);
+        event[i] = FROZEN;
+      }
+    }
+    if(native::maxReduce(N, [this](size_t i) { return double(event[i] == THAWED or event[i] == FROZEN); }) == 0)
+      return false;
+    updateLists(G);
+    return not thawed_nodes.empty();
+  }
+
+  // Error of holding the frozen nodes over a step of size h, in the norm
+  // of type. For WeightedRMS, the modelled components are scaled by the
+  // smallest absolute tolerance, which bounds the weighted error.
+  double frozenError(double h, native::TolType type, const native::Tolerances& tols) const
+  {
+    if(nb_frozen == 0)
+      return 0;
+    if(type == native::MAX_COMPONENT)
+      return h * tol;
+    if(type == native::WEIGHTED_RMS) {
+      double atol = tols.atol[0];
+      for(size_t a = 1 ; a < 5 ; ++a)
+        atol = std::min(atol, tols.atol[a]);
+      return h * tol / atol * std::sqrt(double(frozen_components) / unknowns);
+    }
+    return h * tol * frozen_components / unknowns;
+  }
+
+  // Set the entries of the frozen nodes to 0 in v
+  void zeroFrozen(native::SolverState& v) const
+  {
+    if(nb_frozen == 0 or v.size() != state.size())
+      return;
+    const long N = v.size();
+#pragma omp parallel for schedule(static)
+    for(long i = 0 ; i < N ; ++i)
+      if(state[i] == FROZEN)
+        for(size_t a = 0 ; a < 5 ; ++a)
+          v[i][a] = 0;
+  }
+
+  // The derivatives of the frozen nodes must be checked with a full
+  // evaluation, followed by refresh()
+  bool checkDue() const { return nb_frozen > 0 and steps >= size_t(std::max(check, 1)); }
+
+  const ActiveNodes& active() const { return active_nodes; }
+  const ActiveNodes& thawed() const { return thawed_nodes; }
+  size_t nbFrozen() const { return nb_frozen; }
+
+  bool enabled = false;
+  double tol = 1e-6;        // largest derivative of a quiescent node
+  int window = 20;          // accepted steps below tol before freezing
+  double bound = 1e-3;      // change of a neighbor thawing a frozen node
+  int check = 10;           // accepted steps between two checks of the frozen nodes
+
+protected:
+  enum NodeState
+  {
+    ACTIVE,
+    FROZEN,
+    THAWED,
+    DRIFTED   // only in event
+  };
+
+  static double rate(const SolverPoint5& dc)
+  {
+    double m = 0;
+    for(size_t a = 0 ; a < 5 ; ++a)
+      m = std::max(m, std::abs(double(dc[a])));
+    return m;
+  }
+
+  void zero(size_t i, CompiledGraph& G, std::vector<native::SolverState>& work) const
+  {
+    for(size_t a = 0 ; a < 5 ; ++a)
+      G.dc[i][a] = 0;
+    for(native::SolverState& v: work)
+      if(v.size() == state.size())
+        for(size_t a = 0 ; a < 5 ; ++a)
+          v[i][a] = 0;
+  }
+
+  // Rebuild the lists of active and thawed nodes, the thawed nodes become
+  // active
+  void updateLists(const CompiledGraph& G)
+  {
+    active_nodes.clear();
+    thawed_nodes.clear();
+    nb_frozen = 0;
+    frozen_components = 0;
+    for(size_t i = 0 ; i < state.size() ; ++i) {
+      if(state[i] == FROZEN) {
+        nb_frozen++;
+        frozen_components += CompiledGraph::nbComponents(G.type[i]);
+        continue;
+      }
+      add(active_nodes, G, i);
+      if(state[i] == THAWED) {
+        add(thawed_nodes, G, i);
+        state[i] = ACTIVE;
+      }
+    }
+  }
+
+  static void add(ActiveNodes& nodes, const CompiledGraph& G, size_t i)
+  {
+    switch(G.type[i]) {
+      case NT_CELL:
+        nodes.cells.push_back(G.rank[i]);
+        break;
+      case NT_MEMBRANE:
+        nodes.membranes.push_back(G.rank[i]);
+        break;
+      case NT_APOPLAST:
+        nodes.apoplasts.push_back(G.rank[i]);
+        break;
+    }
+  }
+
+  std::vector<char> state;        // NodeState of each node
+  std::vector<int> quiet;         // consecutive quiet steps of each node
+  std::vector<char> event;        // change of state during the last update
+  native::SolverState ref;        // reference state of the drift of each node
+  size_t nb_frozen = 0;
+  size_t steps = 0;               // accepted steps since the last check
+  size_t frozen_components = 0;   // modelled components of the frozen nodes
+  size_t unknowns = 0;            // modelled components of all the nodes
+  ActiveNodes active_nodes, thawed_nodes;
+};
+
+#endif // QUIESCENCE_H
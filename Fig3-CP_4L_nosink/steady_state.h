@@ -0,0 +1,170 @@
+#ifndef STEADY_STATE_H
+#define STEADY_STATE_H
+
+#include <util/parms.h>
+
+#include <QString>
+
+#include <vector>
+#include <cmath>
+#include <limits>
+
+#include "compiled_graph.h"
+#include "native_ops.h"
+#include "block_matrix.h"
+#include "krylov.h"
+#include "graph_coloring.h"
+
+using cellflips::out;
+
+// Direct computation of the steady state of the CompiledGraph, solving
+// f(c) = 0 with a damped Newton method. If Newton fails, the solve is
+// restarted from the initial state with pseudo-transient continuation:
+//
+//   (I/tau - J) delta = f(c)
+//
+// where the pseudo time step tau grows as the residual decreases (switched
+// evolution relaxation), so the iterations follow the dynamics far from the
+// steady state and become Newton iterations close to it.
+//
+// The model must provide computeDerivatives and computeJacobian, as for the
+// implicit native solvers. The solve is always done in double, whatever the
+// precision of the concentrations stored in the graph.
+class SteadyStateSolver
+{
+public:
+  struct Stats
+  {
+    size_t newton_iterations = 0;
+    size_t ptc_iterations = 0;
+    size_t linear_iterations = 0;
+  };
+
+  void readParms(util::Parms& parms, const QString& section)
+  {
+    parms(section, "SteadyTol", tol);
+    native::readTolType(parms, section, "SteadyTolType", tol_type);
+    parms(section, "SteadyMaxSteps", max_steps);
+    parms(section, "SteadyPseudoDt", pseudo_dt);
+
+    parms(section, "ConjGradTol", linear.tol);
+    native::readTolType(parms, section, "ConjGradTolType", linear.tol_type);
+    parms(section, "ConjGradMaxSteps", linear.max_steps);
+    krylov::readMethod(parms, section, "LinearSolver", linear.method);
+    preconditioner.read(parms, section, "Preconditioner");
+    parms(section, "GMRESRestart", linear.restart);
+    jacobian.readParms(parms, section);
+  }
+
+  // Replace the state of G by its steady state. Returns false, leaving G
+  // unchanged, if neither method converged.
+  template <typename Model>
+  bool operator()(CompiledGraph& G, Model& model)
+  {
+    stats = Stats();
+    if(J.nbRows() != G.nbNodes())
+      J.setStructure(G);
+    if(solve(G, model, false) or solve(G, model, true)) {
+      native::copy(G.c, x);
+      native::copy(G.dc, F);
+      G.stateChanged();
+      return true;
+    }
+    return false;
+  }
+
+  void printStats()
+  {
+    out << "Steady state solver: " << stats.newton_iterations << " Newton iterations, "
+        << stats.ptc_iterations << " pseudo-transient iterations, "
+        << stats.linear_iterations << " linear iterations" << endl;
+  }
+
+  double tol = 1e-8;
+  native::TolType tol_type = native::MAX_COMPONENT;
+  int max_steps = 50;
+  double pseudo_dt = 1;       // initial pseudo time step
+  Stats stats;
+
+protected:
+  static double norm2(const native::State& v)
+  {
+    return std::sqrt(native::dot(v, v));
+  }
+
+  // Solve f(x) = 0 from G.c, the solution is left in x and f(x) in F
+  template <typename Model>
+  bool solve(const CompiledGraph& G, Model& model, bool pseudo_transient)
+  {
+    const size_t N = G.nbNodes();
+    native::copy(x, G.c);
+    F.resize(N);
+    y.resize(N);
+    Fy.resize(N);
+    delta.resize(N);
+    model.computeDerivatives(x, F);
+    double res = norm2(F);
+    double tau = pseudo_dt;
+    auto A = [this](const native::State& v, native::State& Av) {
+      J.multiply(v, Av);
+    };
+    for(int it = 0 ; it < max_steps ; ++it) {
+      if(native::errorNorm(F, tol_type, G.nbUnknowns()) < tol)
+        return true;
+      // A = I/tau - J, or -J for Newton
+      jacobian(G, model, x, F, J);
+      J.scaleAddIdentity(-1, pseudo_transient ? 1/tau : 0);
+      J.setEmptyRowsToIdentity();
+      preconditioner.setup(J);
+      std::fill(delta.begin(), delta.end(), Point5d(0, 0, 0, 0, 0));
+      // The linear tolerance follows the residual, so the convergence is not
+      // limited by the accuracy of the linear solves
+      krylov::Parms lin = linear;
+      lin.unknowns = G.nbUnknowns();
+      lin.tol = std::min(linear.tol, forcing * native::errorNorm(F, linear.tol_type, G.nbUnknowns()));
+      krylov::Result r = krylov::solve(A, preconditioner, F, delta, lin, krylov_work);
+      stats.linear_iterations += r.iterations;
+      if(pseudo_transient) {
+        stats.ptc_iterations++;
+        native::axpy(x, x, 1, delta);
+        model.computeDerivatives(x, F);
+        double new_res = norm2(F);
+        if(not std::isfinite(new_res))
+          return false;
+        tau = std::min(tau * res / new_res, std::numeric_limits<double>::max() / 2);
+        res = new_res;
+        continue;
+      }
+      // Newton, halve the step until the residual decreases enough
+      stats.newton_iterations++;
+      double lambda = 1;
+      while(true) {
+        native::axpy(y, x, lambda, delta);
+        model.computeDerivatives(y, Fy);
+        double new_res = norm2(Fy);
+        if(std::isfinite(new_res) and new_res < (1 - 1e-4 * lambda) * res) {
+          std::swap(x, y);
+          std::swap(F, Fy);
+          res = new_res;
+          break;
+        }
+        lambda /= 2;
+        if(lambda < min_lambda)
+          return false;
+      }
+    }
+    return native::errorNorm(F, tol_type, G.nbUnknowns()) < tol;
+  }
+
+  const double min_lambda = 1./1024;  // smallest Newton damping factor
+  const double forcing = .1;          // linear tolerance relative to the residual
+
+  krylov::Parms linear;
+  krylov::Preconditioner preconditioner;
+  krylov::Workspace krylov_work;
+  JacobianEvaluator jacobian;
+  BlockMatrix J;
+  native::State x, F, y, Fy, delta;
+};
+
+#endif // STEADY_STATE_H
@@ -299,14 +299,11 @@ struct ApoplastLink : public SolverLink
     NodeType type;
     bool is_L1 = false;  // for cells and membranes in the L1
     bool is_sink_membrane = false;  // for membranes of sink cells
-    Point5d c, dc;
+    size_t id;  // index of the node in the CompiledGraph arrays
     double size; // volume or area, depending on the dimension of the item
     RDSolver::VertexInternals interns;
     Point3d normal; // Normal to the membrane or the cell
 
-    void apply() { link->setChems(c, dc); }
-    void read() { link->update(c, dc); }
-
     //void setLink(std::unique_ptr<SolverLink>&& l)
     void setLink(SolverLink *l)
     {
@@ -316,21 +313,21 @@ struct ApoplastLink : public SolverLink
     }
   };
 
-#line 268 "structure.vvh"
+#line 265 "structure.vvh"
 
 
     
   struct p975758e3_f14b_11e7_aac5_3417eba08742_edge_content {
     typedef p975758e3_f14b_11e7_aac5_3417eba08742_edge_content Self;
 
-#line 271 "structure.vvh"
+#line 268 "structure.vvh"
 
     RDSolver::EdgeInternals interns;
     double area;  // used for the area between two neighbor apoplast elements
     double length;  // used for the interface length between two neighbor membrane elements
   };
 
-#line 275 "structure.vvh"
+#line 272 "structure.vvh"
 
 typedef graph::VVGraph<p975758e3_f14b_11e7_aac5_3417eba08742_vertex_content, p975758e3_f14b_11e7_aac5_3417eba08742_edge_content, false> SolverGraph;
 typedef SolverGraph::arc_t arc;
@@ -338,7 +335,7 @@ typedef SolverGraph::edge_t nlink;
 typedef SolverGraph::const_edge_t const_nlink;
 typedef SolverGraph::vertex_t node;
 
-#line 276 "structure.vvh"
+#line 273 "structure.vvh"
 
 
 #endif // STRUCTURE_VVH
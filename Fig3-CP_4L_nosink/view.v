@@ -18,6 +18,15 @@ DrawDt: 0.2
 EndTime: 20000
 PrintInterval: 6
 StoppingThreshold: 5.0e-3
+SteadyState: false // Below StoppingThreshold, solve for the steady state and stop
+Ensemble: false // Integrate together the parameter sets of EnsembleFile
+EnsembleFile: ensemble.txt // Names of the varied [CellChemicals] rates, then one set per line
+Autotune: false // Time the [Solver] configurations of AutotuneFile from the initial state, then stop
+AutotuneFile: autotune.txt // One configuration per line, as `Key: value' pairs separated by `;', the first one is the reference
+AutotuneTime: 5 // Simulated time of each trial
+AutotuneTol: 1e-3 // Largest difference with the reference of the selected configuration
+AutotuneMaxSeconds: 600 // A trial running longer fails
+AutotuneOutput: autotune.v // Pareto front and [Solver] keys of the selected configuration
 MaxTime: 100
 MinVeinPolarisation: 6
 MinVeinPolarisationVariation: 1e-2
@@ -126,9 +135,46 @@ Solver: AdaptiveCrankNicholson  // Euler, AdaptiveEuler, Fixedpoint,
                                         // Midpoint, RungeKutta,
                                         // AdaptiveRungeKutta,
                                         // AdaptiveCrankNicholson
+                                        // Multithreaded (native_solver.h):
+                                        // ParallelEuler, ParallelRungeKutta,
+                                        // ParallelAdaptiveEuler,
+                                        // ParallelAdaptiveRungeKutta,
+                                        // ParallelCrankNicholson (analytic
+                                        // Jacobian, same parms as CN),
+                                        // ParallelIMEX (implicit transport,
+                                        // explicit reactions),
+                                        // ParallelMultirate (membranes
+                                        // sub-cycled, AEuler parms),
+                                        // ParallelRosenbrock (linearly
+                                        // implicit order 2(3), Rosen parms),
+                                        // ParallelBDF (orders 1-5, reuses
+                                        // the Jacobian, BDF and Newt parms),
+                                        // ParallelETD (exponential for the
+                                        // linear decays, ETD parms),
+                                        // ParallelAuto (switches between
+                                        // ParallelAdaptiveRungeKutta and
+                                        // AutoImplicit on stiffness)
+NodeOrdering: RCM			// Numbering of the nodes for the
+                                        // Parallel* solvers: RCM (reverse
+                                        // Cuthill-McKee) or SolverGraph
 
 // Global help:
-//  *TolType can be MeanComponent or MaxComponent
+//  *TolType can be MeanComponent or MaxComponent, or for the Parallel*
+//  solvers WeightedRMS (root mean square of the errors divided by
+//  AbsTol + RelTol * |c| of their chemical, the tolerances are then relative
+//  to 1)
+
+// Per chemical tolerances of the WeightedRMS norm
+AbsTolAuxin: 1e-3			// Absolute tolerance of auxin
+AbsTolPIN: 1e-3				// Absolute tolerance of PIN
+AbsTolAPIN: 1e-3			// Absolute tolerance of APIN
+AbsTolAAUX: 1e-3			// Absolute tolerance of AAUX
+AbsTolVAF: 1e-4				// Absolute tolerance of VAF
+RelTolAuxin: 1e-3			// Relative tolerance of auxin
+RelTolPIN: 1e-3				// Relative tolerance of PIN
+RelTolAPIN: 1e-3			// Relative tolerance of APIN
+RelTolAAUX: 1e-3			// Relative tolerance of AAUX
+RelTolVAF: 1e-3				// Relative tolerance of VAF
 
 // Various Timesteps
 EulerDt: .002//.01 //.0025			// Timestep for Euler solver
@@ -148,6 +194,68 @@ AEulerResTol: 1				// Adaptive Euler restart tolerance
 AEulerLowTol: .3			// Adaptive Euler low water mark
 AEulerHighTol: .4			// Adaptive Euler high water mark
 
+// Quiescent nodes of ParallelEuler, ParallelRungeKutta,
+// ParallelAdaptiveEuler and ParallelAdaptiveRungeKutta
+Quiescent: false			// Freeze the nodes which stopped changing
+QuiescentTol: 1e-6			// Largest derivative of a quiescent node
+QuiescentWindow: 20			// Quiet steps before a node is frozen
+QuiescentBound: 1e-3			// Change of a neighbor thawing a frozen node
+QuiescentCheck: 10			// Steps between two checks of the frozen nodes
+
+// ParallelMultirate parms, the macro step uses the AEuler parms
+MultirateSubsteps: 10			// Membrane sub-steps per macro step
+
+// ParallelIMEX parms, adaptive as Adaptive Euler
+IMEXIncDt: .1				// IMEX Dt increment/decrement
+IMEXResDt: .5				// IMEX restart Dt decrement
+IMEXMinDt: .001				// IMEX min Dt
+IMEXMaxDt: .5				// IMEX max Dt
+IMEXTolType: MaxComponent		// Tolerence type for IMEX
+IMEXResTol: 1				// IMEX restart tolerance
+IMEXLowTol: .3				// IMEX low water mark
+IMEXHighTol: .4				// IMEX high water mark
+
+// ParallelRosenbrock parms, adaptive as Adaptive Euler
+RosenIncDt: .1				// Rosenbrock Dt increment/decrement
+RosenResDt: .5				// Rosenbrock restart Dt decrement
+RosenMinDt: .001			// Rosenbrock min Dt
+RosenMaxDt: 1				// Rosenbrock max Dt
+RosenTolType: MaxComponent		// Tolerence type for Rosenbrock
+RosenResTol: .01			// Rosenbrock restart tolerance
+RosenLowTol: .001			// Rosenbrock low water mark
+RosenHighTol: .005			// Rosenbrock high water mark
+
+// ParallelETD parms, adaptive as Adaptive Euler
+ETDIncDt: .1				// ETD Dt increment/decrement
+ETDResDt: .5				// ETD restart Dt decrement
+ETDMinDt: .001				// ETD min Dt
+ETDMaxDt: 1				// ETD max Dt
+ETDTolType: MaxComponent		// Tolerence type for ETD
+ETDResTol: .01				// ETD restart tolerance
+ETDLowTol: .001				// ETD low water mark
+ETDHighTol: .005			// ETD high water mark
+
+// ParallelAuto parms, each solver uses its own parms
+AutoImplicit: CrankNicholson		// CrankNicholson (always with the PI
+					// controller), Rosenbrock or BDF
+AutoCheckSteps: 10			// Steps between two stiffness checks
+AutoPowerIterations: 10			// Products by the Jacobian per check
+AutoStiffRatio: .8			// Explicit steps above this fraction of
+					// the stability limit switch to implicit
+AutoHysteresis: 2			// Implicit steps below the stability
+					// limit divided by this switch to explicit
+
+// ParallelBDF parms, adaptive as Adaptive Euler, Newton as Crank-Nicholson
+BDFIncDt: .1				// BDF Dt increment/decrement
+BDFResDt: .5				// BDF restart Dt decrement
+BDFMinDt: .001				// BDF min Dt
+BDFMaxDt: 5				// BDF max Dt
+BDFTolType: MaxComponent		// Tolerence type for BDF
+BDFResTol: .01				// BDF restart tolerance
+BDFLowTol: .001				// BDF low water mark
+BDFHighTol: .005			// BDF high water mark
+BDFMaxOrder: 5				// Highest order used, 1 to 5
+
 // Fixed Point iteration parms
 FixedPointMaxSteps: 5		// Max steps for fixed point iteration
 FixedPointTol: .0001			// Tolerance for fixed point iteration
@@ -168,6 +276,14 @@ CRIncDt: .2				// Increment for timestep based on efficiency (mulitple of curren
 CRResDt: .5				// Decrement for timestep if unsucc
 CRAvgCPU: .5            // Weight of current dt in eff average
 CRMinCPU: 5				// Minimun CPU, below this alway increases timestep
+CRController: Efficiency		// ParallelCrankNicholson step control:
+					// Efficiency (CRIncDt, CRAvgCPU, CRMinCPU)
+					// or PI (local error, parms below)
+CRTolType: MaxComponent			// Tolerence type of the PI controller
+CRTol: .001				// Largest local error of an accepted step
+CRSafety: .9				// Safety factor on the PI step size
+CRMaxFactor: 2				// Largest increase of the PI step size
+CRMinFactor: .2				// Largest decrease of the PI step size
 
 // Newton Tolerance (used by Crank Nicholson)
 NewtTol: .00001				// Tolerence for Newton's method
@@ -180,6 +296,27 @@ ConjGradTolType: MaxComponent
 ConjGradMaxSteps: .1			// Max steps for conjugate gradient (multiple of N)
 ConstNbPartials: false			// Set if partials to neighbors are constant (diffusion only)
 
+// Linear solver of ParallelCrankNicholson, ParallelIMEX and of the steady
+// state solver, uses the ConjGrad* tolerances
+LinearSolver: BiCGStab			// ConjugateGradient, BiCGStab, GMRES
+Preconditioner: BlockJacobi		// None, BlockJacobi (per node 5x5 blocks),
+					// ILU0 (block incomplete LU, sequential)
+GMRESRestart: 30			// Size of the Krylov space of GMRES
+Jacobian: Analytic			// Analytic or ColoredFD (finite differences
+					// with Dx, one evaluation per color and
+					// chemical of a distance-2 coloring)
+JacobianMode: Assembled			// Assembled, or MatrixFree (analytic
+					// products, no stored Jacobian, for the
+					// Parallel CN, Rosenbrock and BDF; only
+					// the None and BlockJacobi
+					// preconditioners)
+
+// Steady state solver (Main/SteadyState), uses the linear solver above
+SteadyTol: 1e-8				// Tolerance on the derivatives
+SteadyTolType: MaxComponent
+SteadyMaxSteps: 50			// Max Newton (and pseudo-transient) iterations
+SteadyPseudoDt: 1			// Initial pseudo time step if Newton fails
+
 // Misc general parms
 Dx: 1e-6				// Delta for numerical diff
 PrintMatrix: false			// Print Matrix (Conj-Grad)